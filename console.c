@@ -6,21 +6,44 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "hist.h"
+#include "random.h"
 #include "report.h"
 
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
 /* Some global values */
 int simulation = 0;
 static cmd_ptr cmd_list = NULL;
 static param_ptr param_list = NULL;
+
+/*
+ * Commands and parameters are also indexed by name in open addressing hash
+ * tables, so that looking one up does not have to walk its list.  An index
+ * is rebuilt on the first lookup after something was added to its list.
+ */
+typedef struct {
+    void **slots; /* cmd_ptr or param_ptr, whose first member is the name */
+    size_t mask;  /* Number of slots minus one */
+    bool dirty;
+} name_index_t;
+
+static name_index_t cmd_index = {NULL, 0, true};
+static name_index_t param_index = {NULL, 0, true};
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -34,6 +57,10 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ *
+ * Regular files are mapped read-only instead.  Each line is copied out of
+ * the mapping into mapped_line, and the pages already consumed are released
+ * as reading goes on, so a long trace never stays resident as a whole.
  */
 
 #define RIO_BUFSIZE 8192
@@ -44,12 +71,23 @@ struct RIO_ELE {
     int cnt;               /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Mapped file, or NULL if read through buf */
+    size_t map_size;       /* Size of mapped file */
+    char *mapptr;          /* Next unread byte in mapped file */
+    size_t dropped;        /* Bytes at the start of the mapping released */
     rio_ptr prev;          /* Next element in stack */
 };
 
 static rio_ptr buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
+/* Line copied out of a mapped file, grown as needed */
+static char *mapped_line = NULL;
+static size_t mapped_line_cap = 0;
+
+/* Consumed part of a mapping worth releasing in one call */
+#define RIO_DROP_SIZE (1 << 20)
+
 /* Maximum file descriptor */
 static int fd_max = 0;
 
@@ -75,6 +113,7 @@ static bool push_file(char *fname);
 static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
+static void echo_line(const char *line);
 
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
@@ -90,8 +129,10 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->name = name;
     ele->operation = operation;
     ele->documentation = documentation;
+    ele->latency = NULL;
     ele->next = next_cmd;
     *last_loc = ele;
+    cmd_index.dirty = true;
 }
 
 /* Add a new parameter */
@@ -114,52 +155,145 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+    param_index.dirty = true;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* FNV-1a hash of a name */
+static uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Empty index with room for cnt entries at a load factor of at most 1/2 */
+static void index_reset(name_index_t *index, size_t cnt)
+{
+    if (index->slots)
+        free_array(index->slots, index->mask + 1, sizeof(void *));
+
+    size_t size = 16;
+    while (size < 2 * cnt)
+        size *= 2;
+    index->slots = calloc_or_fail(size, sizeof(void *), "index_reset");
+    index->mask = size - 1;
+    index->dirty = false;
+}
+
+static void index_free(name_index_t *index)
+{
+    if (index->slots)
+        free_array(index->slots, index->mask + 1, sizeof(void *));
+    index->slots = NULL;
+    index->dirty = true;
+}
+
+/* Entries with the same name are found in the order they were inserted */
+static void index_insert(name_index_t *index, void *ele)
+{
+    size_t i = hash_name(*(char **) ele) & index->mask;
+    while (index->slots[i])
+        i = (i + 1) & index->mask;
+    index->slots[i] = ele;
+}
+
+static void *index_find(const name_index_t *index, const char *name)
+{
+    for (size_t i = hash_name(name) & index->mask; index->slots[i];
+         i = (i + 1) & index->mask) {
+        if (strcmp(*(char **) index->slots[i], name) == 0)
+            return index->slots[i];
+    }
+    return NULL;
+}
+
+static cmd_ptr find_cmd(const char *name)
+{
+    if (cmd_index.dirty) {
+        size_t cnt = 0;
+        for (cmd_ptr c = cmd_list; c; c = c->next)
+            cnt++;
+        index_reset(&cmd_index, cnt);
+        for (cmd_ptr c = cmd_list; c; c = c->next)
+            index_insert(&cmd_index, c);
+    }
+    return index_find(&cmd_index, name);
+}
+
+static param_ptr find_param(const char *name)
+{
+    if (param_index.dirty) {
+        size_t cnt = 0;
+        for (param_ptr p = param_list; p; p = p->next)
+            cnt++;
+        index_reset(&param_index, cnt);
+        for (param_ptr p = param_list; p; p = p->next)
+            index_insert(&param_index, p);
+    }
+    return index_find(&param_index, name);
+}
+
+static void *realloc_or_fail(void *p, size_t bytes, char *fun_name)
+{
+    p = realloc(p, bytes);
+    if (!p)
+        report_event(MSG_FATAL, "Realloc returned NULL in %s", fun_name);
+    return p;
+}
+
+/* Argument vector, grown as needed and reused from one line to the next */
+typedef struct {
+    char **argv;
+    int cap;
+} argv_buf_t;
+
+/* Vector of the command lines run by interpret_cmd() */
+static argv_buf_t cmd_args;
+
+/*
+ * Parse a string into a command line.
+ * The string is split in place, by overwriting the first white space after
+ * each argument with a null character, and the arguments are collected in
+ * buf, which the next call with the same buf overwrites.
+ */
+static char **parse_args(char *line, argv_buf_t *buf, int *argcp)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
+    char *p = line;
+    for (;;) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+
+        /* Hit start of new word */
+        if (argc == buf->cap) {
+            buf->cap = buf->cap ? 2 * buf->cap : 16;
+            buf->argv = realloc_or_fail(buf->argv, buf->cap * sizeof(char *),
+                                        "parse_args");
         }
-    }
+        buf->argv[argc++] = p;
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+        while (*p != '\0' && !isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        /* Hit end of word */
+        *p++ = '\0';
     }
 
-    free_block(buf, len + 1);
     *argcp = argc;
-    return argv;
+    return buf->argv;
+}
+
+static void free_args(argv_buf_t *buf)
+{
+    free(buf->argv);
+    buf->argv = NULL;
+    buf->cap = 0;
 }
 
 static void record_error()
@@ -171,18 +305,77 @@ static void record_error()
     }
 }
 
+/* Command being run, and whether it recorded its own latencies */
+static cmd_ptr current_cmd = NULL;
+static bool latency_recorded = false;
+
+/* Whether a metrics row was written since the command being run started */
+static bool metrics_written = false;
+
+static void latency_add(cmd_ptr cmd, uint64_t ns)
+{
+    /* Kept outside the tracked allocator, so that the metrics row of the
+     * first run does not count the histogram against the command.
+     */
+    if (!cmd->latency) {
+        cmd->latency = realloc_or_fail(NULL, sizeof(hist_t), "latency_add");
+        hist_reset(cmd->latency);
+    }
+    hist_record(cmd->latency, ns);
+}
+
+void latency_record(uint64_t ns)
+{
+    if (current_cmd) {
+        latency_add(current_cmd, ns);
+        latency_recorded = true;
+    }
+}
+
+/* Run a command, recording its latency.  A command that runs others, such
+ * as time, leaves the metrics rows to them.
+ */
+static bool dispatch(cmd_ptr cmd, int argc, char *argv[])
+{
+    cmd_ptr saved_cmd = current_cmd;
+    bool saved_recorded = latency_recorded;
+    bool saved_written = metrics_written;
+    current_cmd = cmd;
+    latency_recorded = false;
+    metrics_written = false;
+
+    metrics_mark_t mark;
+    bool metrics = metrics_enabled();
+    if (metrics)
+        metrics_start(&mark, allocation_check());
+
+    uint64_t start = now_ns();
+    bool ok = cmd->operation(argc, argv);
+    uint64_t elapsed = now_ns() - start;
+    /* Quitting releases the command and closes the metrics */
+    if (!quit_flag) {
+        if (!latency_recorded)
+            latency_add(cmd, elapsed);
+        if (metrics && !metrics_written)
+            metrics_finish(&mark, cmd->name, ok, elapsed, allocation_check());
+    }
+
+    current_cmd = saved_cmd;
+    latency_recorded = saved_recorded;
+    metrics_written = saved_written || metrics;
+    return ok;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = find_cmd(argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+        ok = dispatch(next_cmd, argc, argv);
         if (!ok)
             record_error();
     } else {
@@ -194,6 +387,112 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
+/*
+ * Recording of sessions.
+ *
+ * While recording, every command given at top level is appended to the
+ * record file along with the time it started and its result, so that the
+ * session can be replayed later.  The file starts with a magic number, and
+ * each record holds the start time in nanoseconds of CLOCK_MONOTONIC, the
+ * result as a byte, the length of the command as 32 bits, and the command
+ * with its arguments separated by single spaces.  Each time recording to
+ * the file starts, a record with an empty command marks a new session, as
+ * the clock may have been reset since the last one, e.g. by a reboot.
+ */
+#define RECORD_MAGIC 0x31525451 /* "QTR1" */
+
+static FILE *record_file = NULL;
+static bool replaying = false;
+
+/* When replay issues commands, see do_replay() */
+enum {
+    REPLAY_FAST,
+    REPLAY_RECORDED,
+    REPLAY_CONSTANT,
+    REPLAY_POISSON,
+};
+static int replay_mode = REPLAY_FAST;
+static int replay_rate = 1000;
+
+/* Latency of the commands of the last replay */
+static hist_t replay_latency;
+
+/* Should the command be recorded?  Commands that run other commands are
+ * left out, since those are recorded on their own.
+ */
+static bool is_recorded(int argc, char *argv[])
+{
+    if (!record_file || replaying || argc == 0)
+        return false;
+    return strcmp(argv[0], "record") && strcmp(argv[0], "replay") &&
+           strcmp(argv[0], "source") && strcmp(argv[0], "quit");
+}
+
+static void record_cmd(uint64_t start, bool ok, int argc, char *argv[])
+{
+    uint8_t result = ok;
+    uint32_t len = argc ? argc - 1 : 0;
+    for (int i = 0; i < argc; i++)
+        len += strlen(argv[i]);
+
+    fwrite(&start, sizeof(start), 1, record_file);
+    fwrite(&result, sizeof(result), 1, record_file);
+    fwrite(&len, sizeof(len), 1, record_file);
+    for (int i = 0; i < argc; i++) {
+        fputs(argv[i], record_file);
+        if (i < argc - 1)
+            fputc(' ', record_file);
+    }
+}
+
+bool set_record_file(char *fname)
+{
+    if (record_file) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+    if (!fname)
+        return true;
+
+    FILE *file = fopen(fname, "a+b");
+    if (!file)
+        return false;
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+    /* Keep appending to an earlier recording */
+    uint32_t magic;
+    if (fread(&magic, sizeof(magic), 1, file) == 1) {
+        if (magic != RECORD_MAGIC) {
+            fclose(file);
+            return false;
+        }
+        fseek(file, 0, SEEK_END);
+    } else {
+        magic = RECORD_MAGIC;
+        fseek(file, 0, SEEK_END);
+        fwrite(&magic, sizeof(magic), 1, file);
+    }
+
+    record_file = file;
+    record_cmd(now_ns(), true, 0, NULL);
+    return true;
+}
+
+/* Execute a command line that has been split into arguments, recording it
+ * if a record file is open
+ */
+static bool interpret_argv(int argc, char *argv[])
+{
+    /* Decided up front, as quit releases the arguments */
+    if (!is_recorded(argc, argv))
+        return interpret_cmda(argc, argv);
+
+    uint64_t start = now_ns();
+    bool ok = interpret_cmda(argc, argv);
+    record_cmd(start, ok, argc, argv);
+    return ok;
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -204,13 +503,8 @@ static bool interpret_cmd(char *cmdline)
     report(6, "Interpreting command '%s'\n", cmdline);
 #endif
     int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    char **argv = parse_args(cmdline, &cmd_args, &argc);
+    return interpret_argv(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -236,6 +530,8 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
+        if (ele->latency)
+            free(ele->latency);
         free_block(ele, sizeof(cmd_ele));
     }
 
@@ -246,13 +542,25 @@ static bool do_quit(int argc, char *argv[])
         free_block(ele, sizeof(param_ele));
     }
 
-    while (buf_stack)
-        pop_file();
+    index_free(&cmd_index);
+    index_free(&param_index);
 
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    set_record_file(NULL);
+    close_metrics_file(allocation_check());
+
+    /* The arguments may live in mapped_line or in cmd_args */
+    while (buf_stack)
+        pop_file();
+
+    free_args(&cmd_args);
+    free(mapped_line);
+    mapped_line = NULL;
+    mapped_line_cap = 0;
+
     quit_flag = true;
     return ok;
 }
@@ -317,7 +625,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -326,23 +633,16 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        /* Find parameter */
+        param_ptr param = find_param(name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
@@ -397,6 +697,401 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static void report_latency(cmd_ptr cmd)
+{
+    const hist_t *h = cmd->latency;
+    report(1, "%-10s %10" PRIu64 " %10.3f %10.3f %10.3f %10.3f %10.3f",
+           cmd->name, h->total, hist_percentile(h, 50) / 1e3,
+           hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+           hist_percentile(h, 99.99) / 1e3, h->max / 1e3);
+}
+
+static bool do_latency(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    cmd_ptr cmd = NULL;
+    if (argc == 2) {
+        cmd = find_cmd(argv[1]);
+        if (!cmd) {
+            report(1, "Unknown command '%s'", argv[1]);
+            return false;
+        }
+        if (!cmd->latency) {
+            report(1, "Command '%s' has not run yet", argv[1]);
+            return false;
+        }
+    }
+
+    report(1, "%-10s %10s %10s %10s %10s %10s %10s", "Latency", "count",
+           "p50 (us)", "p99", "p99.9", "p99.99", "max");
+    if (cmd) {
+        report_latency(cmd);
+        return true;
+    }
+    for (cmd = cmd_list; cmd; cmd = cmd->next) {
+        if (cmd->latency)
+            report_latency(cmd);
+    }
+    return true;
+}
+
+static bool do_record(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (!set_record_file(argc == 2 ? argv[1] : NULL)) {
+        report(1, "Couldn't record to '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 2)
+        report(1, "Recording commands to '%s'", argv[1]);
+    else
+        report(1, "Stopped recording");
+    return true;
+}
+
+/* Wait until the given CLOCK_MONOTONIC time.  A sleep overshoots by the
+ * timer slack of the kernel, so the last stretch is spent spinning.
+ */
+#define SPIN_NS 200000
+
+static void wait_until(uint64_t t)
+{
+    if (now_ns() + SPIN_NS < t) {
+        struct timespec ts = {
+            .tv_sec = (t - SPIN_NS) / 1000000000,
+            .tv_nsec = (t - SPIN_NS) % 1000000000,
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+            ;
+    }
+    while (now_ns() < t)
+        ;
+}
+
+/*
+ * Replay a recorded session.
+ *
+ * By default every command is issued as soon as the previous one is done,
+ * which measures throughput.  The other modes are open loop: each command
+ * has an arrival time, at its recorded offset from the first command of its
+ * session, with each session following on from the last arrival, or at
+ * a constant rate, or with exponentially distributed gaps at the given mean
+ * rate.  A command that arrives while an earlier one still runs has to wait,
+ * and its latency counts from its arrival, so the latencies reported include
+ * the queueing delay that callers would see.
+ */
+static bool do_replay(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a record file", argv[0]);
+        return false;
+    }
+    if ((replay_mode == REPLAY_CONSTANT || replay_mode == REPLAY_POISSON) &&
+        replay_rate <= 0) {
+        report(1, "Replay mode %d needs a positive replay_rate", replay_mode);
+        return false;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    uint32_t magic;
+    if (!file || fread(&magic, sizeof(magic), 1, file) != 1 ||
+        magic != RECORD_MAGIC) {
+        report(1, "Could not read record file '%s'", argv[1]);
+        if (file)
+            fclose(file);
+        return false;
+    }
+
+    /* Replayed lines are split into their own vector, as argv may be the
+     * vector of interpret_cmd(), and are not recorded again.
+     */
+    argv_buf_t args = {0};
+    char *line = NULL;
+    size_t line_size = 0;
+    uint32_t cnt = 0, mismatch_cnt = 0;
+    uint64_t ts, first_ts = 0, start = now_ns(), arrival = start;
+    uint64_t session_start = start;
+    bool new_session = true;
+    uint8_t result;
+    uint32_t len;
+    bool ok = true;
+    hist_reset(&replay_latency);
+    replaying = true;
+    while (!quit_flag && fread(&ts, sizeof(ts), 1, file) == 1 &&
+           fread(&result, sizeof(result), 1, file) == 1 &&
+           fread(&len, sizeof(len), 1, file) == 1) {
+        if (len + 1 > line_size) {
+            line_size = len + 1;
+            line = realloc_or_fail(line, line_size, "do_replay");
+        }
+        if (fread(line, 1, len, file) != len) {
+            report(1, "Record file is truncated");
+            ok = false;
+            break;
+        }
+        line[len] = '\0';
+        if (!len) {
+            new_session = true;
+            continue;
+        }
+
+        switch (replay_mode) {
+        case REPLAY_RECORDED:
+            /* The idle time between sessions is not replayed */
+            if (new_session) {
+                first_ts = ts;
+                session_start = arrival;
+                new_session = false;
+            }
+            /* Clocks only go forward within a session, unless it was
+             * recorded without session marks
+             */
+            arrival = session_start + (ts > first_ts ? ts - first_ts : 0);
+            break;
+        case REPLAY_CONSTANT:
+            arrival = start + (uint64_t) (cnt * 1e9 / replay_rate);
+            break;
+        case REPLAY_POISSON:
+            if (cnt) {
+                double u = 1.0 - prng_double(PRNG_REPLAY);
+                arrival += (uint64_t) (-log(u) * 1e9 / replay_rate);
+            }
+            break;
+        default:
+            arrival = now_ns();
+        }
+        if (replay_mode != REPLAY_FAST)
+            wait_until(arrival);
+
+        echo_line(line);
+        int line_argc;
+        char **line_argv = parse_args(line, &args, &line_argc);
+        if (interpret_argv(line_argc, line_argv) != result)
+            mismatch_cnt++;
+        hist_record(&replay_latency, now_ns() - arrival);
+        cnt++;
+    }
+    replaying = false;
+    fclose(file);
+    free(line);
+    free_args(&args);
+
+    report(1, "Replayed %u commands in %.3f seconds", cnt,
+           (now_ns() - start) / 1e9);
+    report(1, "Latency (us): p50 %.3f, p99 %.3f, p99.9 %.3f, max %.3f",
+           hist_percentile(&replay_latency, 50) / 1e3,
+           hist_percentile(&replay_latency, 99) / 1e3,
+           hist_percentile(&replay_latency, 99.9) / 1e3,
+           replay_latency.max / 1e3);
+    if (mismatch_cnt) {
+        report(1, "ERROR: %u commands did not give their recorded result",
+               mismatch_cnt);
+        ok = false;
+    }
+    return ok;
+}
+
+/*
+ * Compiled traces.
+ *
+ * The compile command turns a trace into a binary file, which run_binary()
+ * replays without parsing anything.  The file starts with a header, holds
+ * every distinct word of the trace once as a null-terminated string, and
+ * ends with the commands, each being its number of words followed by the
+ * index of every word, as unsigned LEB128 numbers.  Typical commands thus
+ * take a few bytes each.
+ */
+#define TRACE_MAGIC 0x31425451 /* "QTB1" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t string_cnt;  /* Number of distinct strings */
+    uint32_t string_size; /* Bytes taken by strings, null characters included */
+    uint32_t cmd_cnt;     /* Number of commands */
+    uint32_t arg_cnt;     /* Number of words of all commands */
+    uint32_t stream_size; /* Bytes taken by commands */
+} trace_header_t;
+
+/* Command of a compiled trace, ready to run */
+typedef struct {
+    cmd_ptr cmd;
+    int argc;
+    char **argv;
+} trace_cmd_t;
+
+/* Distinct strings of a trace being compiled, indexed by an open addressing
+ * hash table of string indices plus one, so that zero marks an empty slot.
+ */
+typedef struct {
+    char **strings;
+    uint32_t cnt, cap;
+    uint32_t size;
+    uint32_t *slots;
+    size_t mask;
+} intern_t;
+
+static void intern_slot(intern_t *in, uint32_t i)
+{
+    size_t j = hash_name(in->strings[i]) & in->mask;
+    while (in->slots[j])
+        j = (j + 1) & in->mask;
+    in->slots[j] = i + 1;
+}
+
+/* Return the index of s, adding a copy of it if it is new */
+static uint32_t intern(intern_t *in, const char *s)
+{
+    size_t j = hash_name(s) & in->mask;
+    for (; in->slots[j]; j = (j + 1) & in->mask) {
+        if (strcmp(in->strings[in->slots[j] - 1], s) == 0)
+            return in->slots[j] - 1;
+    }
+
+    if (in->cnt == in->cap) {
+        in->cap *= 2;
+        in->strings = realloc_or_fail(
+            in->strings, in->cap * sizeof(char *), "intern");
+    }
+    uint32_t i = in->cnt++;
+    in->strings[i] = strdup(s);
+    if (!in->strings[i])
+        report_event(MSG_FATAL, "Strdup returned NULL in intern");
+    in->size += strlen(s) + 1;
+
+    /* Keep the load factor at most 1/2 */
+    if (2 * in->cnt > in->mask + 1) {
+        free(in->slots);
+        in->mask = 2 * in->mask + 1;
+        in->slots = calloc(in->mask + 1, sizeof(uint32_t));
+        if (!in->slots)
+            report_event(MSG_FATAL, "Calloc returned NULL in intern");
+        for (uint32_t k = 0; k < in->cnt; k++)
+            intern_slot(in, k);
+    } else {
+        in->slots[j] = i + 1;
+    }
+    return i;
+}
+
+/* Append x to stream as an unsigned LEB128 number, returning the new size */
+static size_t put_number(uint8_t *stream, size_t size, uint32_t x)
+{
+    while (x >= 0x80) {
+        stream[size++] = (x & 0x7f) | 0x80;
+        x >>= 7;
+    }
+    stream[size++] = x;
+    return size;
+}
+
+/* Read an unsigned LEB128 number at *pos, moving past it.  Return false if
+ * the stream ends within the number or the number does not fit.
+ */
+static bool get_number(const uint8_t *stream,
+                       size_t size,
+                       size_t *pos,
+                       uint32_t *x)
+{
+    *x = 0;
+    for (int shift = 0; shift < 35 && *pos < size; shift += 7) {
+        uint8_t b = stream[(*pos)++];
+        *x |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool do_compile(int argc, char *argv[])
+{
+    if (argc != 3) {
+        report(1, "%s needs source and destination files", argv[0]);
+        return false;
+    }
+
+    FILE *src = fopen(argv[1], "r");
+    if (!src) {
+        report(1, "Could not open source file '%s'", argv[1]);
+        return false;
+    }
+
+    intern_t in = {
+        .cap = 64,
+        .strings = malloc(64 * sizeof(char *)),
+        .mask = 127,
+        .slots = calloc(128, sizeof(uint32_t)),
+    };
+    uint32_t cmd_cnt = 0, arg_cnt = 0;
+    size_t stream_size = 0, stream_cap = 4096;
+    uint8_t *stream = malloc(stream_cap);
+    if (!in.strings || !in.slots || !stream)
+        report_event(MSG_FATAL, "Malloc returned NULL in do_compile");
+
+    /* Not the vector of interpret_cmd(), which holds argv */
+    argv_buf_t args = {0};
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, src) != -1) {
+        int line_argc;
+        char **line_argv = parse_args(line, &args, &line_argc);
+        if (line_argc > 0) {
+            /* Each number takes at most 5 bytes */
+            size_t need = stream_size + 5 * (line_argc + 1);
+            if (need > stream_cap) {
+                while (need > stream_cap)
+                    stream_cap *= 2;
+                stream = realloc_or_fail(stream, stream_cap, "do_compile");
+            }
+            stream_size = put_number(stream, stream_size, line_argc);
+            for (int i = 0; i < line_argc; i++)
+                stream_size = put_number(stream, stream_size,
+                                         intern(&in, line_argv[i]));
+            cmd_cnt++;
+            arg_cnt += line_argc;
+        }
+    }
+    free(line);
+    free_args(&args);
+    fclose(src);
+
+    trace_header_t header = {
+        .magic = TRACE_MAGIC,
+        .string_cnt = in.cnt,
+        .string_size = in.size,
+        .cmd_cnt = cmd_cnt,
+        .arg_cnt = arg_cnt,
+        .stream_size = stream_size,
+    };
+    FILE *dst = fopen(argv[2], "wb");
+    bool ok = dst && fwrite(&header, sizeof(header), 1, dst) == 1;
+    for (uint32_t i = 0; ok && i < in.cnt; i++)
+        ok = fwrite(in.strings[i], strlen(in.strings[i]) + 1, 1, dst) == 1;
+    ok = ok && (!stream_size || fwrite(stream, stream_size, 1, dst) == 1);
+    if (dst && fclose(dst))
+        ok = false;
+
+    if (ok)
+        report(1, "Compiled %u commands with %u distinct strings into '%s'",
+               cmd_cnt, in.cnt, argv[2]);
+    else
+        report(1, "Could not write compiled trace '%s'", argv[2]);
+
+    for (uint32_t i = 0; i < in.cnt; i++)
+        free(in.strings[i]);
+    free(in.strings);
+    free(in.slots);
+    free(stream);
+    return ok;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
@@ -411,11 +1106,27 @@ void init_cmd()
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(latency,
+                " [cmd]          | Show latency percentiles of cmd (default: "
+                "of every command run)");
+    ADD_COMMAND(record,
+                " [file]         | Record commands to file (default: stop)");
+    ADD_COMMAND(replay,
+                " file           | Replay commands recorded to file");
+    ADD_COMMAND(compile,
+                " src dst        | Compile trace src into binary trace dst, "
+                "for replay with qtest -b");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
+    add_param("replay_mode", &replay_mode,
+              "When replay issues commands (0: as fast as possible, "
+              "1: as recorded, 2: at constant rate, 3: at Poisson arrivals)",
+              NULL);
+    add_param("replay_rate", &replay_rate,
+              "Commands per second for replay modes 2 and 3", NULL);
 
     init_in();
     init_time(&last_time);
@@ -440,6 +1151,23 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_size = 0;
+    rnew->dropped = 0;
+
+    /* Stdin, pipes, and anything else that cannot be mapped is read */
+    struct stat st;
+    if (fname && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_size = st.st_size;
+            rnew->mapptr = map;
+        }
+    }
+
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -452,6 +1180,8 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_size);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -463,6 +1193,53 @@ static void init_in()
     buf_stack = NULL;
 }
 
+static void echo_line(const char *line)
+{
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, "%s", line);
+        if (!*line || line[strlen(line) - 1] != '\n')
+            report_noreturn(1, "\n");
+    }
+}
+
+/* Read the next line of a mapped file into mapped_line, without its newline */
+static char *readline_mapped()
+{
+    rio_ptr rio = buf_stack;
+    char *line = rio->mapptr;
+    size_t left = rio->map + rio->map_size - line;
+    if (left == 0) {
+        /* Encountered EOF */
+        pop_file();
+        return NULL;
+    }
+
+    /* The last line of the file may not terminate with a newline */
+    char *end = memchr(line, '\n', left);
+    size_t len = end ? (size_t) (end - line) : left;
+    rio->mapptr = end ? end + 1 : line + left;
+
+    if (len + 1 > mapped_line_cap) {
+        mapped_line_cap = len + 1 > RIO_BUFSIZE ? len + 1 : RIO_BUFSIZE;
+        mapped_line =
+            realloc_or_fail(mapped_line, mapped_line_cap, "readline_mapped");
+    }
+    memcpy(mapped_line, line, len);
+    mapped_line[len] = '\0';
+
+    /* Hand the pages read so far back to the page cache */
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t done = (rio->mapptr - rio->map) & ~(page - 1);
+    if (done - rio->dropped >= RIO_DROP_SIZE) {
+        madvise(rio->map + rio->dropped, done - rio->dropped, MADV_DONTNEED);
+        rio->dropped = done;
+    }
+
+    echo_line(mapped_line);
+    return mapped_line;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
@@ -475,6 +1252,9 @@ static char *readline()
     if (!buf_stack)
         return NULL;
 
+    if (buf_stack->map)
+        return readline_mapped();
+
     for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
         if (buf_stack->cnt <= 0) {
             /* Need to read from input file */
@@ -488,10 +1268,7 @@ static char *readline()
                     /*  Terminate line & return it */
                     *lptr++ = '\n';
                     *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
+                    echo_line(linebuf);
                     return linebuf;
                 }
                 return NULL;
@@ -512,11 +1289,7 @@ static char *readline()
     }
     *lptr++ = '\0';
 
-    if (echo) {
-        report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
-    }
-
+    echo_line(linebuf);
     return linebuf;
 }
 
@@ -555,10 +1328,12 @@ int cmd_select(int nfds,
         /* Add input fd to readset for select */
         infd = buf_stack->fd;
         FD_SET(infd, readfds);
-        if (infd == STDIN_FILENO && prompt_flag) {
-            printf("%s", prompt);
+        if (infd == STDIN_FILENO) {
+            if (prompt_flag)
+                printf("%s", prompt);
+            /* Show what the last command printed before waiting */
+            report_flush();
             fflush(stdout);
-            prompt_flag = true;
         }
 
         if (infd >= nfds)
@@ -645,11 +1420,15 @@ bool run_console(char *infile_name)
 
     if (!has_infile) {
         char *cmdline;
+        report_flush();
         while ((cmdline = linenoise(prompt)) != NULL) {
-            interpret_cmd(cmdline);
+            /* Before the command is split up in place */
             linenoiseHistoryAdd(cmdline);       /* Add to the history. */
             linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
+            interpret_cmd(cmdline);
             linenoiseFree(cmdline);
+            /* linenoise writes the prompt straight to the terminal */
+            report_flush();
         }
     } else {
         while (!cmd_done())
@@ -658,3 +1437,154 @@ bool run_console(char *infile_name)
 
     return err_cnt == 0;
 }
+
+static void echo_argv(int argc, char *argv[])
+{
+    if (echo) {
+        report_noreturn(1, prompt);
+        for (int i = 0; i < argc - 1; i++)
+            report_noreturn(1, "%s ", argv[i]);
+        report_noreturn(1, "%s\n", argv[argc - 1]);
+    }
+}
+
+/* Load a compiled trace, with every command resolved and its arguments in
+ * place.  Return the number of commands, or -1 if the file is unusable.
+ */
+static int load_binary(char *fname,
+                       trace_header_t **mapp,
+                       size_t *map_size,
+                       char ***argsp,
+                       trace_cmd_t **cmdsp)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(trace_header_t))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    trace_header_t *header = map;
+    size_t size = sizeof(*header) + (size_t) header->string_size +
+                  header->stream_size;
+    char *strings = (char *) (header + 1);
+    if (header->magic != TRACE_MAGIC || size != (size_t) st.st_size ||
+        (header->string_size && strings[header->string_size - 1])) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    char **string_ptrs =
+        malloc_or_fail((header->string_cnt + 1) * sizeof(char *), "load");
+    uint32_t cnt = 0;
+    for (char *p = strings;
+         p < strings + header->string_size && cnt < header->string_cnt;
+         p += strlen(p) + 1)
+        string_ptrs[cnt++] = p;
+
+    char **args =
+        malloc_or_fail((header->arg_cnt + 1) * sizeof(char *), "load");
+    trace_cmd_t *cmds =
+        malloc_or_fail((header->cmd_cnt + 1) * sizeof(trace_cmd_t), "load");
+    const uint8_t *stream = (const uint8_t *) strings + header->string_size;
+    bool ok = cnt == header->string_cnt;
+    size_t pos = 0, a = 0;
+    for (uint32_t i = 0; ok && i < header->cmd_cnt; i++) {
+        uint32_t argc, index;
+        ok = get_number(stream, header->stream_size, &pos, &argc) &&
+             argc > 0 && argc <= header->arg_cnt - a;
+        for (uint32_t j = 0; ok && j < argc; j++) {
+            ok = get_number(stream, header->stream_size, &pos, &index) &&
+                 index < header->string_cnt;
+            if (ok)
+                args[a + j] = string_ptrs[index];
+        }
+        if (ok) {
+            cmds[i].argc = argc;
+            cmds[i].argv = &args[a];
+            cmds[i].cmd = find_cmd(args[a]);
+            a += argc;
+        }
+    }
+    free_block(string_ptrs, (header->string_cnt + 1) * sizeof(char *));
+
+    if (!ok) {
+        free_block(args, (header->arg_cnt + 1) * sizeof(char *));
+        free_block(cmds, (header->cmd_cnt + 1) * sizeof(trace_cmd_t));
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    *mapp = header;
+    *map_size = st.st_size;
+    *argsp = args;
+    *cmdsp = cmds;
+    return header->cmd_cnt;
+}
+
+bool run_binary(char *fname)
+{
+    trace_header_t *header;
+    size_t map_size;
+    char **args;
+    trace_cmd_t *cmds;
+    int cmd_cnt = load_binary(fname, &header, &map_size, &args, &cmds);
+    if (cmd_cnt < 0) {
+        report(1, "ERROR: Could not load compiled trace '%s'", fname);
+        return false;
+    }
+
+    /* The words of the trace are read-only and shared by every command
+     * using them, so each command gets a copy it may edit.
+     */
+    char *scratch = NULL;
+    size_t scratch_size = 0;
+    for (int i = 0; i < cmd_cnt && !quit_flag; i++) {
+        size_t need = 0;
+        for (int j = 0; j < cmds[i].argc; j++)
+            need += strlen(cmds[i].argv[j]) + 1;
+        if (need > scratch_size) {
+            scratch_size = 2 * need;
+            scratch = realloc_or_fail(scratch, scratch_size, "run_binary");
+        }
+        char *p = scratch;
+        for (int j = 0; j < cmds[i].argc; j++) {
+            size_t len = strlen(cmds[i].argv[j]) + 1;
+            memcpy(p, cmds[i].argv[j], len);
+            cmds[i].argv[j] = p;
+            p += len;
+        }
+
+        echo_argv(cmds[i].argc, cmds[i].argv);
+        bool recorded = is_recorded(cmds[i].argc, cmds[i].argv);
+        uint64_t start = recorded ? now_ns() : 0;
+        bool ok = cmds[i].cmd != NULL;
+        if (!ok) {
+            report(1, "Unknown command '%s'", cmds[i].argv[0]);
+            record_error();
+        } else if (!(ok = dispatch(cmds[i].cmd, cmds[i].argc,
+                                   cmds[i].argv))) {
+            record_error();
+        }
+        if (recorded)
+            record_cmd(start, ok, cmds[i].argc, cmds[i].argv);
+
+        /* Run any file the command sourced to completion */
+        while (buf_stack && !quit_flag) {
+            char *cmdline = readline();
+            if (cmdline)
+                interpret_cmd(cmdline);
+        }
+    }
+
+    free(scratch);
+    free_block(args, (header->arg_cnt + 1) * sizeof(char *));
+    free_block(cmds, (header->cmd_cnt + 1) * sizeof(trace_cmd_t));
+    munmap(header, map_size);
+    return err_cnt == 0;
+}
@@ -1,7 +1,10 @@
 #ifndef LAB0_CONSOLE_H
 #define LAB0_CONSOLE_H
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
+#include <time.h>
+#include "hist.h"
 #include "linenoise.h"
 #define HISTORY_FILE ".cmd_history"
 
@@ -21,6 +24,7 @@ struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
+    hist_t *latency; /* Allocated once the command has run */
     cmd_ptr next;
 };
 
@@ -79,6 +83,27 @@ int cmd_select(int nfds,
  */
 bool run_console(char *infile_name);
 
+/* Run commands of a trace compiled by the compile command */
+bool run_binary(char *fname);
+
+/* Record commands to fname, or stop recording if fname is NULL */
+bool set_record_file(char *fname);
+
+/* Current time of CLOCK_MONOTONIC in nanoseconds */
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Record the latency, in nanoseconds, of one operation of the command being
+ * run.  A command that repeats an operation calls this for every repetition,
+ * and is then not timed as a whole.  Other commands are timed as a whole.
+ */
+void latency_record(uint64_t ns);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
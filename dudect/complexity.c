@@ -0,0 +1,237 @@
+/** Complexity classification of queue operations.
+ *
+ * The operation under test is timed on queues of growing sizes, and each
+ * candidate model t = a + c * f(n) is fitted to the timings by least
+ * squares, a standing for the fixed cost of a call.  The model with the
+ * smallest root mean square error, normalized by the mean time, is deemed
+ * the complexity class of the operation.
+ *
+ * Notes:
+ *
+ *  - near-linear models fit each other's timings almost as well, so a
+ *    model is only preferred over a slower growing one when its error is
+ *    clearly smaller.
+ *
+ *  - the smallest time out of several repetitions is kept for each size,
+ *    since interruptions only ever make an operation look slower.
+ *
+ *  - the cost of visiting a node grows with the queue size, as the queue
+ *    spills out of each level of cache, which makes linear operations look
+ *    superlinear.  Sizes are kept small enough to stay within the inner
+ *    caches, and every measurement is expressed in units of the time a
+ *    plain walk over the same queue takes per node.
+ */
+
+#include "complexity.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "../random.h"
+#include "queue.h"
+#include "timer.h"
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "../harness.h"
+
+/* Queue sizes are min_size, 2 * min_size, ..., up to number_sizes sizes */
+#define min_size 256
+#define number_sizes 6
+
+/* Repetitions per size, the fastest of which is kept */
+#define number_reps 7
+
+#define complexity_tries 3
+
+/* A faster growing model must cut the error by this factor to be chosen */
+#define fit_margin 2
+
+#define number_strings 1024
+#define string_size 8
+
+static char strings[number_strings][string_size];
+
+static const char *complexity_names[complexity_number] = {
+    [complexity_1] = "O(1)",
+    [complexity_log_n] = "O(log n)",
+    [complexity_n] = "O(n)",
+    [complexity_n_log_n] = "O(n log n)",
+    [complexity_n_squared] = "O(n^2)",
+};
+
+const char *complexity_name(complexity_t c)
+{
+    return c < complexity_number ? complexity_names[c] : "unknown";
+}
+
+static double model(complexity_t c, double n)
+{
+    switch (c) {
+    case complexity_log_n:
+        return log2(n);
+    case complexity_n:
+        return n;
+    case complexity_n_log_n:
+        return n * log2(n);
+    case complexity_n_squared:
+        return n * n;
+    default:
+        return 1;
+    }
+}
+
+/* Random lowercase strings, so that sorting has real work to do */
+static void prepare_strings(void)
+{
+    prng_fill_lower(PRNG_MEASURE, strings[0], sizeof(strings));
+    for (size_t i = 0; i < number_strings; i++)
+        strings[i][string_size - 1] = '\0';
+}
+
+/* Time a single call of op on a fresh queue of n elements, along with a
+ * plain walk over the queue right before it.  Return false if the queue
+ * could not be built.
+ */
+static bool measure_once(int op, int n, int64_t *op_time, int64_t *walk_time)
+{
+    struct list_head *l = q_new();
+    if (!l)
+        return false;
+    for (int i = 0; i < n; i++) {
+        if (!q_insert_head(l, strings[i % number_strings])) {
+            without_cautious_mode(q_free(l));
+            return false;
+        }
+    }
+
+    /* Walk twice, so that both the timed walk and op find the queue in
+     * whatever cache level it fits into.
+     */
+    int64_t start = 0, stop = 0;
+    for (int w = 0; w < 2; w++) {
+        start = cpucycles_start();
+        for (struct list_head *node = l->next; node != l; node = node->next)
+            __asm__ volatile("" : : "r"(node));
+        stop = cpucycles_stop();
+    }
+    *walk_time = timer_elapsed(start, stop);
+
+    start = cpucycles_start();
+    switch (op) {
+    case complexity_size:
+        q_size(l);
+        break;
+    case complexity_delete_mid:
+        q_delete_mid(l);
+        break;
+    case complexity_reverse:
+        q_reverse(l);
+        break;
+    case complexity_swap:
+        q_swap(l);
+        break;
+    case complexity_sort:
+        q_sort(l);
+        break;
+    }
+    stop = cpucycles_stop();
+    *op_time = timer_elapsed(start, stop);
+
+    /* Freeing in cautious mode is quadratic, which would dominate the run */
+    without_cautious_mode(q_free(l));
+    return true;
+}
+
+complexity_t measure_complexity(int op)
+{
+    double sizes[number_sizes], times[number_sizes];
+
+    timer_setup();
+    prepare_strings();
+    for (int i = 0; i < number_sizes; i++) {
+        int n = min_size << i;
+        int64_t best_op = INT64_MAX, best_walk = INT64_MAX;
+        for (int r = 0; r < number_reps; r++) {
+            int64_t op_time, walk_time;
+            if (!measure_once(op, n, &op_time, &walk_time)) {
+                timer_finish();
+                printf("\033[A\033[2K");
+                printf("Could not build a queue of %d elements\n", n);
+                return complexity_number;
+            }
+            if (op_time < best_op)
+                best_op = op_time;
+            if (walk_time < best_walk)
+                best_walk = walk_time;
+        }
+        if (best_op < 1)
+            best_op = 1;
+        if (best_walk < 1)
+            best_walk = 1;
+        sizes[i] = n;
+        /* Time in units of node visits of a plain walk */
+        times[i] = (double) best_op * n / best_walk;
+    }
+    timer_finish();
+
+    double mean = 0;
+    for (int i = 0; i < number_sizes; i++)
+        mean += times[i] / number_sizes;
+
+    complexity_t best_fit = complexity_1;
+    double best_rms = INFINITY;
+    for (complexity_t c = complexity_1; c < complexity_number; c++) {
+        /* Least squares fit of times = base + coef * model(sizes), where
+         * base absorbs the fixed cost of a call
+         */
+        double mean_f = 0;
+        for (int i = 0; i < number_sizes; i++)
+            mean_f += model(c, sizes[i]) / number_sizes;
+        double sum_tf = 0, sum_ff = 0;
+        for (int i = 0; i < number_sizes; i++) {
+            double f = model(c, sizes[i]) - mean_f;
+            sum_tf += (times[i] - mean) * f;
+            sum_ff += f * f;
+        }
+        /* A constant model has nothing to scale, and a growing cost
+         * cannot shrink with the size
+         */
+        double coef = sum_ff > 0 && sum_tf > 0 ? sum_tf / sum_ff : 0;
+        double base = mean - coef * mean_f;
+
+        double rms = 0;
+        for (int i = 0; i < number_sizes; i++) {
+            double err = times[i] - base - coef * model(c, sizes[i]);
+            rms += err * err / number_sizes;
+        }
+        rms = sqrt(rms) / mean;
+
+        if (rms * fit_margin < best_rms) {
+            best_rms = rms;
+            best_fit = c;
+        }
+    }
+
+    printf("\033[A\033[2K");
+    printf("best fit: %s, normalized rms: %.3f\n", complexity_name(best_fit),
+           best_rms);
+    return best_fit;
+}
+
+bool is_complexity_within(int op, complexity_t expected)
+{
+    static const char *op_names[] = {
+        [complexity_size] = "size",       [complexity_delete_mid] = "dm",
+        [complexity_reverse] = "reverse", [complexity_swap] = "swap",
+        [complexity_sort] = "sort",
+    };
+    bool result = false;
+
+    for (int cnt = 0; cnt < complexity_tries && !result; ++cnt) {
+        printf("Testing %s complexity...(%d/%d)\n\n", op_names[op], cnt,
+               complexity_tries);
+        result = measure_complexity(op) <= expected;
+        printf("\033[A\033[2K\033[A\033[2K");
+    }
+    return result;
+}
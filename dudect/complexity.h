@@ -0,0 +1,36 @@
+#ifndef DUDECT_COMPLEXITY_H
+#define DUDECT_COMPLEXITY_H
+
+#include <stdbool.h>
+
+/* Complexity classes, in increasing order of growth */
+typedef enum {
+    complexity_1,
+    complexity_log_n,
+    complexity_n,
+    complexity_n_log_n,
+    complexity_n_squared,
+    complexity_number,
+} complexity_t;
+
+/* Queue operations whose complexity can be classified */
+enum {
+    complexity_size,
+    complexity_delete_mid,
+    complexity_reverse,
+    complexity_swap,
+    complexity_sort,
+};
+
+/* Measure operation op across queue sizes and return the complexity class
+ * that fits the measurements best.
+ */
+complexity_t measure_complexity(int op);
+
+/* Big O notation of a complexity class */
+const char *complexity_name(complexity_t c);
+
+/* Interface to test if a function grows no faster than expected */
+bool is_complexity_within(int op, complexity_t expected);
+
+#endif
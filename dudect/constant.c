@@ -7,11 +7,20 @@
 #include <string.h>
 #include <unistd.h>
 #include "cpucycles.h"
+#include "perfcounter.h"
 #include "queue.h"
 #include "random.h"
+#include "timer.h"
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "../harness.h"
 
 #define N_MEASURE 150
 
+/* Queue sizes range from 0 to pool_size - 1 */
+#define pool_size 10000
+
 /* Allow random number range from 0 to 65535 */
 const size_t chunk_size = 16;
 
@@ -20,11 +29,22 @@ const size_t n_measure = N_MEASURE;
 
 const int drop_size = 20;
 
+/* Counter used for the measurements */
+int measure_counter = counter_tsc;
+
 /* Maintain a queue independent from the qtest since
  * we do not want the test to affect the original functionality
  */
 static struct list_head *l = NULL;
 
+/* The queue is built once with pool_size elements, whose nodes are kept
+ * here in list order.  A queue of k elements is then cut out of it in O(1)
+ * by linking the head to the first k nodes only, and sewn back after the
+ * measurement, so that no sample pays for building or freeing a queue and
+ * the allocator state is the same for both classes.
+ */
+static struct list_head *pool_nodes[pool_size];
+
 static char random_string[N_MEASURE][8];
 static int random_string_iter = 0;
 
@@ -35,9 +55,116 @@ enum {
     test_remove_tail,
 };
 
+static inline int64_t counter_start(void)
+{
+    return measure_counter == counter_tsc ? cpucycles_start()
+                                          : perf_counter_read();
+}
+
+static inline int64_t counter_stop(void)
+{
+    return measure_counter == counter_tsc ? cpucycles_stop()
+                                          : perf_counter_read();
+}
+
+/* Restore the link between pool node i and its successor */
+static inline void pool_relink(size_t i)
+{
+    if (i + 1 < pool_size) {
+        pool_nodes[i]->next = pool_nodes[i + 1];
+        pool_nodes[i + 1]->prev = pool_nodes[i];
+    }
+}
+
+/* Turn the queue into its first k pool elements */
+static void pool_take(size_t k)
+{
+    if (k == 0) {
+        INIT_LIST_HEAD(l);
+        return;
+    }
+
+    pool_nodes[k - 1]->next = l;
+    l->prev = pool_nodes[k - 1];
+
+    /* Rewrite the links of the neighbours the operations under test may
+     * write to, so that their cache lines are owned before the measurement
+     * whichever part of the pool they sit in.
+     */
+    if (k > 1) {
+        pool_relink(0);
+        pool_relink(k - 2);
+    }
+}
+
+/* Sew the first k elements back into the pool, undoing whatever an insert
+ * or remove at either end did to the links around them.
+ */
+static void pool_put(size_t k)
+{
+    if (k > 0) {
+        pool_relink(0);
+        if (k > 1)
+            pool_relink(k - 2);
+        pool_relink(k - 1);
+    }
+    l->next = pool_nodes[0];
+    pool_nodes[0]->prev = l;
+    l->prev = pool_nodes[pool_size - 1];
+    pool_nodes[pool_size - 1]->next = l;
+}
+
+/* Release the element an insert added at the given end of the queue */
+static void release_inserted(struct list_head *node)
+{
+    list_del(node);
+    without_cautious_mode(q_release_element(list_entry(node, element_t, list)));
+}
+
+/* Build the queue the pool is cut from and collect its nodes */
+static bool build_pool(void)
+{
+    char s[8];
+    l = q_new();
+    if (!l)
+        return false;
+    for (size_t i = 0; i < pool_size; i++) {
+        prng_fill_lower(PRNG_MEASURE, s, sizeof(s) - 1);
+        s[sizeof(s) - 1] = 0;
+        if (!q_insert_tail(l, s))
+            return false;
+    }
+
+    size_t i = 0;
+    struct list_head *node;
+    list_for_each (node, l) {
+        if (i == pool_size)
+            return false;
+        pool_nodes[i++] = node;
+    }
+    return i == pool_size;
+}
+
 /* Implement the necessary queue interface to simulation */
-void init_dut(void)
+bool init_dut(void)
 {
+    if (l)
+        return true;
+
+    /* The pool is not under test, so none of its allocations is failed */
+    bool ok;
+    without_fault_injection(ok = build_pool());
+    if (!ok)
+        free_dut();
+    return ok;
+}
+
+void free_dut(void)
+{
+    if (!l)
+        return;
+
+    without_cautious_mode(q_free(l));
     l = NULL;
 }
 
@@ -47,6 +174,11 @@ char *get_random_string(void)
     return random_string[random_string_iter];
 }
 
+/* The classes, and the inputs that size the queues, must not be repeatable,
+ * or the measurements could line up with them, so they come from the
+ * kernel.  The strings only fill the elements and come from the seeded
+ * generator.
+ */
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, n_measure * chunk_size);
@@ -56,11 +188,17 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
             memset(input_data + (size_t) i * chunk_size, 0, chunk_size);
     }
 
-    for (size_t i = 0; i < N_MEASURE; ++i) {
-        /* Generate random string */
-        randombytes((uint8_t *) random_string[i], 7);
+    prng_fill_lower(PRNG_MEASURE, random_string[0], sizeof(random_string));
+    for (size_t i = 0; i < N_MEASURE; ++i)
         random_string[i][7] = 0;
-    }
+}
+
+/* Size of the queue measurement i runs on.  Class 0 always gets an empty
+ * queue.
+ */
+static inline size_t queue_size(const uint8_t *input_data, size_t i)
+{
+    return *(uint16_t *) (input_data + i * chunk_size) % pool_size;
 }
 
 void measure(int64_t *before_ticks,
@@ -75,67 +213,58 @@ void measure(int64_t *before_ticks,
     case test_insert_head:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            size_t k = queue_size(input_data, i);
+            pool_take(k);
+            before_ticks[i] = counter_start();
+            bool ok = q_insert_head(l, s);
+            after_ticks[i] = counter_stop();
+            if (ok)
+                release_inserted(l->next);
+            pool_put(k);
         }
         break;
     case test_insert_tail:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            size_t k = queue_size(input_data, i);
+            pool_take(k);
+            before_ticks[i] = counter_start();
+            bool ok = q_insert_tail(l, s);
+            after_ticks[i] = counter_stop();
+            if (ok)
+                release_inserted(l->prev);
+            pool_put(k);
         }
         break;
     case test_remove_head:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            if (e)
-                q_release_element(e);
-            dut_free();
+            size_t k = queue_size(input_data, i);
+            pool_take(k);
+            before_ticks[i] = counter_start();
+            /* The removed element stays in the pool */
+            q_remove_head(l, NULL, 0);
+            after_ticks[i] = counter_stop();
+            pool_put(k);
         }
         break;
     case test_remove_tail:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            if (e)
-                q_release_element(e);
-            dut_free();
+            size_t k = queue_size(input_data, i);
+            pool_take(k);
+            before_ticks[i] = counter_start();
+            q_remove_tail(l, NULL, 0);
+            after_ticks[i] = counter_stop();
+            pool_put(k);
         }
         break;
     default:
         for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
+            size_t k = queue_size(input_data, i);
+            pool_take(k);
+            before_ticks[i] = counter_start();
             dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            after_ticks[i] = counter_stop();
+            pool_put(k);
         }
     }
 }
@@ -1,3 +1,6 @@
+#ifndef DUDECT_CPUCYCLES_H
+#define DUDECT_CPUCYCLES_H
+
 #include <stdint.h>
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
 static inline int64_t cpucycles(void)
@@ -21,3 +24,52 @@ static inline int64_t cpucycles(void)
 #error Unsupported Architecture
 #endif
 }
+
+/* Serialized counterparts of cpucycles() for a start/stop pair.
+ * The start read waits for all earlier loads and stores to complete, so
+ * that the setup of a measurement does not leak into it, and keeps later
+ * instructions from executing before the counter is read.  The stop read
+ * waits for the measured instructions to retire.
+ */
+static inline int64_t cpucycles_start(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("mfence\n\tlfence\n\trdtsc\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi)
+                     :
+                     : "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("dsb sy\n\tisb\n\tmrs %0, cntvct_el0\n\tisb"
+                 : "=r"(val)
+                 :
+                 : "memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
+
+static inline int64_t cpucycles_stop(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("rdtscp\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi)
+                     :
+                     : "ecx", "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val) : : "memory");
+    return val;
+#else
+#error Unsupported Architecture
+#endif
+}
+
+#endif
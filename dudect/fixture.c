@@ -24,6 +24,11 @@
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
+ *
+ *  - the statistics can be kept in a store file across runs. Every run then
+ *    adopts the cropping thresholds of the stored ones, so that the cropped
+ *    tests stay comparable, and judges the stored measurements along with
+ *    its own.
  */
 
 #include "fixture.h"
@@ -36,15 +41,62 @@
 #include "../console.h"
 #include "../random.h"
 #include "constant.h"
+#include "perfcounter.h"
+#include "timer.h"
 #include "ttest.h"
 
 #define enough_measure 10000
 #define test_tries 10
 
+/* Number of cropping thresholds used for the cropped t-tests */
+#define number_percentiles 100
+
+/* One uncropped test, one test per percentile, and one second-order test */
+#define number_tests (1 + number_percentiles + 1)
+
+/* Cropped and second-order tests are ignored until they hold this many
+ * measurements, so that a handful of samples cannot dominate max t.
+ */
+#define enough_measure_per_test (enough_measure / 10)
+
+/* Margin, in standard errors of t, kept by the sequential stopping rule */
+#define t_margin 3
+
 extern const int drop_size;
 extern const size_t chunk_size;
 extern const size_t n_measure;
 static t_ctx *t;
+static int64_t percentiles[number_percentiles];
+static bool percentiles_ready = false;
+
+/* Stop a try as soon as its verdict is decisive, off unless asked for */
+int sequential_test = 0;
+static bool decisive = false;
+
+/* "dudt" in little endian, followed by the layout version */
+#define store_magic 0x74647564
+#define store_version 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t number_thresholds;
+    uint32_t number_records;
+} store_header_t;
+
+/* Statistics of one test, keyed by its name and counter */
+typedef struct {
+    char name[16];
+    int32_t counter;
+    int32_t padding;
+    int64_t percentiles[number_percentiles];
+    t_ctx t[number_tests];
+} store_record_t;
+
+static char *store_file = NULL;
+
+/* Statistics of the previous runs of the test under way */
+static store_record_t stored;
 
 /* threshold values for Welch's t-test */
 enum {
@@ -61,34 +113,130 @@ static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
 {
+    /* Only the cycle counter has a calibrated overhead to take off */
+    int64_t overhead = measure_counter == counter_tsc ? timer_overhead : 0;
     for (size_t i = 0; i < n_measure; i++)
-        exec_times[i] = after_ticks[i] - before_ticks[i];
+        exec_times[i] = after_ticks[i] - before_ticks[i] - overhead;
+}
+
+static int cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Derive the cropping thresholds from the measurements of a warm-up batch.
+ * The thresholds are spaced so that most of them lie in the tail, where
+ * the interesting differences between the classes show up.
+ */
+static void prepare_percentiles(const int64_t *exec_times)
+{
+    size_t size = n_measure - drop_size * 2;
+    int64_t sorted[size];
+
+    memcpy(sorted, exec_times + drop_size, size * sizeof(int64_t));
+    qsort(sorted, size, sizeof(int64_t), cmp);
+    for (size_t i = 0; i < number_percentiles; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / number_percentiles);
+        size_t pos = (size_t) (size * which);
+        assert(pos < size);
+        percentiles[i] = sorted[pos];
+    }
+    percentiles_ready = true;
 }
 
 static void update_statistics(const int64_t *exec_times, uint8_t *classes)
 {
-    for (size_t i = 0; i < n_measure; i++) {
+    for (size_t i = drop_size; i < n_measure - drop_size; i++) {
         int64_t difference = exec_times[i];
-        /* CPU cycle counter overflowed or dropped measurement */
-        if (difference <= 0)
+        /* CPU cycle counter overflowed. Event counters may well read zero. */
+        if (difference < 0)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&t[0], difference, classes[i]);
+
+        /* do a t-test on cropped execution times, for several thresholds */
+        for (size_t crop = 0; crop < number_percentiles; crop++) {
+            if (difference < percentiles[crop])
+                t_push(&t[crop + 1], difference, classes[i]);
+        }
+
+        /* do a second-order test on the centered product, once the means
+         * are stable enough to center on
+         */
+        if (t[0].n[0] + t[0].n[1] > enough_measure_per_test) {
+            double centered = difference - t[0].mean[classes[i]];
+            t_push(&t[number_tests - 1], centered * centered, classes[i]);
+        }
+    }
+}
+
+/* Return the test with the largest t statistic */
+static t_ctx *max_test(t_ctx *tests)
+{
+    t_ctx *ret = &tests[0];
+    double max = 0;
+    for (size_t i = 0; i < number_tests; i++) {
+        if (i > 0 && tests[i].n[0] + tests[i].n[1] <= enough_measure_per_test)
+            continue;
+        /* Event counts without any variance leave t undefined */
+        double x = fabs(t_compute(&tests[i]));
+        if (isnan(x))
+            continue;
+        if (max < x) {
+            max = x;
+            ret = &tests[i];
+        }
     }
+    return ret;
+}
+
+/* In sequential mode, a try ends as soon as the remaining measurements can
+ * no longer change its verdict: either t is already past the "bananas"
+ * threshold, or the upper confidence bound of t, projected to the full
+ * number of measurements, still stays below the moderate threshold.  A pass
+ * is only decided once max_test() takes every test into account, so that
+ * the cropped tests still too small to count cannot be skipped.
+ */
+static bool is_decisive(const t_ctx *tests, double max_t, double number_traces)
+{
+    if (max_t > t_threshold_bananas)
+        return true;
+    for (size_t i = 1; i < number_tests; i++) {
+        if (tests[i].n[0] + tests[i].n[1] <= enough_measure_per_test)
+            return false;
+    }
+
+    double remaining = sqrt(enough_measure / number_traces);
+    return (max_t + t_margin) * remaining < t_threshold_moderate;
 }
 
 static bool report(void)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
+    /* Judge the stored measurements along with those of this run */
+    t_ctx merged[number_tests];
+    for (size_t i = 0; i < number_tests; i++) {
+        merged[i] = stored.t[i];
+        t_merge(&merged[i], &t[i]);
+    }
+
+    t_ctx *tmax = max_test(merged);
+    double max_t = fabs(t_compute(tmax));
+    /* A cropped test holds only part of the measurements.  max_tau is
+     * normalized by the measurements of the test it was taken from, while
+     * progress is judged on all of them.
+     */
+    double number_traces = merged[0].n[0] + merged[0].n[1];
+    double number_traces_max_t = tmax->n[0] + tmax->n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < enough_measure) {
+    printf("meas: %7.2lf M, ", (number_traces / 1e6));
+    decisive = sequential_test && is_decisive(merged, max_t, number_traces);
+    if (number_traces < enough_measure && !decisive) {
         printf("not enough measurements (%.0f still to go).\n",
-               enough_measure - number_traces_max_t);
+               enough_measure - number_traces);
         return false;
     }
 
@@ -134,8 +282,15 @@ static bool doit(int mode)
 
     measure(before_ticks, after_ticks, input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    bool ret = report();
+
+    /* The first batch only serves to set up the cropping thresholds */
+    bool ret = false;
+    if (!percentiles_ready) {
+        prepare_percentiles(exec_times);
+    } else {
+        update_statistics(exec_times, classes);
+        ret = report();
+    }
 
     free(before_ticks);
     free(after_ticks);
@@ -146,27 +301,192 @@ static bool doit(int mode)
     return ret;
 }
 
-static void init_once(void)
+/* Read every record of the store file.  A missing file holds no records,
+ * while a file that cannot be read or was written with another layout is
+ * reported and treated alike.
+ */
+static store_record_t *store_read(uint32_t *number_records)
+{
+    *number_records = 0;
+    FILE *file = fopen(store_file, "rb");
+    if (!file)
+        return NULL;
+
+    store_header_t header;
+    store_record_t *records = NULL;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != store_magic || header.version != store_version ||
+        header.number_thresholds != number_percentiles) {
+        printf("Ignoring store '%s' of unknown format\n", store_file);
+        goto out;
+    }
+
+    records = malloc(header.number_records * sizeof(store_record_t));
+    if (header.number_records && !records)
+        die();
+    if (fread(records, sizeof(store_record_t), header.number_records, file) !=
+        header.number_records) {
+        printf("Ignoring truncated store '%s'\n", store_file);
+        free(records);
+        records = NULL;
+        goto out;
+    }
+    *number_records = header.number_records;
+
+out:
+    fclose(file);
+    return records;
+}
+
+static store_record_t *store_find(store_record_t *records,
+                                  uint32_t number_records,
+                                  const char *text)
+{
+    for (uint32_t i = 0; i < number_records; i++) {
+        if (!strncmp(records[i].name, text, sizeof(records[i].name)) &&
+            records[i].counter == measure_counter)
+            return &records[i];
+    }
+    return NULL;
+}
+
+/* Pick up the statistics and cropping thresholds of the previous runs */
+static void store_load(const char *text)
 {
-    init_dut();
-    t_init(t);
+    memset(&stored, 0, sizeof(stored));
+    for (size_t i = 0; i < number_tests; i++)
+        t_init(&stored.t[i]);
+    if (!store_file)
+        return;
+
+    uint32_t number_records;
+    store_record_t *records = store_read(&number_records);
+    store_record_t *record = store_find(records, number_records, text);
+    if (record) {
+        stored = *record;
+        memcpy(percentiles, stored.percentiles, sizeof(percentiles));
+        percentiles_ready = true;
+    }
+    free(records);
+}
+
+/* Merge the statistics of this run into the store.  The file is read
+ * again rather than trusting what store_load() saw, so that runs sharing
+ * the file do not count each other twice, and replaced atomically.
+ */
+static void store_save(const char *text)
+{
+    if (!store_file || !percentiles_ready)
+        return;
+
+    uint32_t number_records;
+    store_record_t *records = store_read(&number_records);
+    store_record_t *record = store_find(records, number_records, text);
+    if (record && memcmp(record->percentiles, percentiles,
+                         sizeof(percentiles))) {
+        /* Cropped tests with other thresholds cannot be merged */
+        printf("Replacing stored '%s', whose thresholds have changed\n",
+               text);
+        for (size_t i = 0; i < number_tests; i++)
+            t_init(&record->t[i]);
+        memcpy(record->percentiles, percentiles, sizeof(percentiles));
+    }
+    if (!record) {
+        store_record_t *grown =
+            realloc(records, (number_records + 1) * sizeof(store_record_t));
+        if (!grown)
+            die();
+        records = grown;
+        record = &records[number_records++];
+        memset(record, 0, sizeof(*record));
+        strncpy(record->name, text, sizeof(record->name) - 1);
+        record->counter = measure_counter;
+        memcpy(record->percentiles, percentiles, sizeof(percentiles));
+        for (size_t i = 0; i < number_tests; i++)
+            t_init(&record->t[i]);
+    }
+    for (size_t i = 0; i < number_tests; i++)
+        t_merge(&record->t[i], &t[i]);
+
+    char tmp_file[strlen(store_file) + 5];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", store_file);
+    store_header_t header = {
+        .magic = store_magic,
+        .version = store_version,
+        .number_thresholds = number_percentiles,
+        .number_records = number_records,
+    };
+    FILE *file = fopen(tmp_file, "wb");
+    bool ok = file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(records, sizeof(store_record_t), number_records, file) ==
+                  number_records;
+    if (file && fclose(file))
+        ok = false;
+    if (!ok || rename(tmp_file, store_file)) {
+        printf("Couldn't write store '%s'\n", store_file);
+        remove(tmp_file);
+    }
+    free(records);
+}
+
+void set_const_store(const char *file)
+{
+    free(store_file);
+    store_file = file ? strdup(file) : NULL;
+}
+
+static bool init_once(const char *text)
+{
+    if (!init_dut())
+        return false;
+    for (size_t i = 0; i < number_tests; i++)
+        t_init(&t[i]);
+    percentiles_ready = false;
+    decisive = false;
+    store_load(text);
+    return true;
 }
 
 static bool TEST_CONST(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    t = malloc(number_tests * sizeof(t_ctx));
+
+    timer_setup();
+    /* A counter that cannot be opened is replaced for this test only */
+    int requested_counter = measure_counter;
+    if (measure_counter != counter_tsc && !perf_counter_open(measure_counter)) {
+        printf("WARNING: Counter '%s' is not available, using tsc for this "
+               "test\n",
+               perf_counter_name(measure_counter));
+        measure_counter = counter_tsc;
+    }
 
     for (int cnt = 0; cnt < test_tries; ++cnt) {
-        printf("Testing %s...(%d/%d)\n\n", text, cnt, test_tries);
-        init_once();
-        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 1;
-             ++i)
+        printf("Testing %s with %s...(%d/%d)\n\n", text,
+               perf_counter_name(measure_counter), cnt, test_tries);
+        if (!init_once(text)) {
+            printf("\033[A\033[2K");
+            printf("Could not build the queue to measure %s on\n", text);
+            result = false;
+            break;
+        }
+        /* One extra batch for the warm-up that sets up the percentiles */
+        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 2;
+             ++i) {
             result = doit(mode);
+            if (decisive)
+                break;
+        }
+        store_save(text);
         printf("\033[A\033[2K\033[A\033[2K");
         if (result == true)
             break;
     }
+    perf_counter_close();
+    timer_finish();
+    measure_counter = requested_counter;
+    free_dut();
     free(t);
     return result;
 }
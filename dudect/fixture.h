@@ -4,6 +4,14 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Stop each try as soon as its verdict is decisive.  Off by default. */
+extern int sequential_test;
+
+/* Keep the statistics of constant-time tests in file across runs, merging
+ * every run into it.  Pass NULL to stop doing so.
+ */
+void set_const_store(const char *file);
+
 /* Interface to test if function is constant */
 bool is_insert_head_const(void);
 bool is_insert_tail_const(void);
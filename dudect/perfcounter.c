@@ -0,0 +1,159 @@
+/* Hardware performance counters for dudect.
+ *
+ * The time stamp counter only tells that an operation took longer, not why.
+ * Counting retired instructions, cache misses or branch misses instead lets
+ * the same t-tests point at the cause of a timing leak.  Only user space
+ * events are counted.
+ *
+ * The counter is read with rdpmc, through the page the kernel maps for it,
+ * so that no kernel code runs next to the measured code and evicts its
+ * cache lines.  Where rdpmc is not allowed (e.g. /sys/devices/cpu/rdpmc is
+ * 0), not supported, or the counter is not scheduled on the PMU, a read()
+ * system call is the fallback; its cost shows up in the cache miss counts.
+ */
+
+#include "perfcounter.h"
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int perf_fd = -1;
+
+/* Page the kernel publishes the state of the counter in */
+static struct perf_event_mmap_page *perf_page = NULL;
+static size_t perf_page_size = 0;
+
+static const char *counter_names[counter_number] = {
+    [counter_tsc] = "tsc",
+    [counter_cycles] = "cycles",
+    [counter_instructions] = "instructions",
+    [counter_l1d_misses] = "L1D misses",
+    [counter_llc_misses] = "LLC misses",
+    [counter_branch_misses] = "branch misses",
+};
+
+bool perf_counter_open(int counter)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    switch (counter) {
+    case counter_cycles:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case counter_instructions:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case counter_l1d_misses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case counter_llc_misses:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case counter_branch_misses:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    default:
+        return false;
+    }
+
+    perf_counter_close();
+    perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+        return false;
+
+    /* Without the page, every read goes through read() */
+    perf_page_size = sysconf(_SC_PAGESIZE);
+    perf_page = mmap(NULL, perf_page_size, PROT_READ, MAP_SHARED, perf_fd, 0);
+    if (perf_page == MAP_FAILED)
+        perf_page = NULL;
+
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    return true;
+}
+
+static int64_t read_syscall(void)
+{
+    uint64_t count = 0;
+    if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return (int64_t) count;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static inline uint64_t rdpmc(uint32_t counter)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return lo | ((uint64_t) hi << 32);
+}
+
+/* Read the counter in user space, as documented in perf_event_open(2).
+ * The kernel bumps lock while it updates the page, so a read that saw it
+ * change is retried.
+ */
+int64_t perf_counter_read(void)
+{
+    struct perf_event_mmap_page *pc = perf_page;
+    if (!pc || !pc->cap_user_rdpmc)
+        return read_syscall();
+
+    uint32_t seq, index;
+    int64_t count;
+    do {
+        seq = pc->lock;
+        __asm__ volatile("" ::: "memory");
+        index = pc->index;
+        count = pc->offset;
+        if (!index)
+            return read_syscall(); /* Not on the PMU right now */
+        uint16_t width = pc->pmc_width;
+        int64_t pmc = rdpmc(index - 1);
+        /* Sign extend the counter from its width */
+        pmc <<= 64 - width;
+        pmc >>= 64 - width;
+        count += pmc;
+        __asm__ volatile("" ::: "memory");
+    } while (pc->lock != seq);
+    return count;
+}
+#else
+int64_t perf_counter_read(void)
+{
+    return read_syscall();
+}
+#endif
+
+void perf_counter_close(void)
+{
+    if (perf_page) {
+        munmap(perf_page, perf_page_size);
+        perf_page = NULL;
+    }
+    if (perf_fd >= 0) {
+        close(perf_fd);
+        perf_fd = -1;
+    }
+}
+
+const char *perf_counter_name(int counter)
+{
+    if (counter < 0 || counter >= counter_number)
+        return "unknown";
+    return counter_names[counter];
+}
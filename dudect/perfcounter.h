@@ -0,0 +1,32 @@
+#ifndef DUDECT_PERFCOUNTER_H
+#define DUDECT_PERFCOUNTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Counters which the execution of a function can be measured with */
+enum {
+    counter_tsc,           /* Raw cycle counter, see cpucycles.h */
+    counter_cycles,        /* CPU cycles */
+    counter_instructions,  /* Instructions retired */
+    counter_l1d_misses,    /* L1 data cache read misses */
+    counter_llc_misses,    /* Last level cache misses */
+    counter_branch_misses, /* Mispredicted branches */
+    counter_number,
+};
+
+/* Open a hardware counter through perf_event_open.
+ * Return false if the counter is not available on this system.
+ */
+bool perf_counter_open(int counter);
+
+/* Current value of the opened counter */
+int64_t perf_counter_read(void);
+
+/* Release the opened counter */
+void perf_counter_close(void);
+
+/* Human readable name of a counter */
+const char *perf_counter_name(int counter);
+
+#endif
@@ -0,0 +1,87 @@
+/* Calibrated cycle timer.
+ *
+ * Short operations such as q_remove_head take only a few dozen cycles, so
+ * the cost of reading the counter itself and the noise from migrations and
+ * frequency changes would otherwise dominate their measurement.
+ */
+
+#define _GNU_SOURCE
+#include "timer.h"
+#include <sched.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Number of empty measurements taken to find the timer overhead */
+#define calibration_rounds 10000
+
+/* Nanoseconds to keep the CPU busy for before calibrating */
+#define warmup_ns 50000000
+
+int64_t timer_overhead = 0;
+static bool timer_ready = false;
+
+/* CPUs the process may run on outside of measurements */
+static cpu_set_t saved_cpus;
+static bool pinned = false;
+
+/* Keep the process on one CPU so that counters of different CPUs are
+ * never compared.  Failing to pin is not fatal, only noisier.
+ */
+static void pin_cpu(void)
+{
+    int cpu = sched_getcpu();
+    if (pinned || cpu < 0 ||
+        sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus))
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pinned = !sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* Spin for a while to get the CPU out of its low power states */
+static void warm_up(void)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L +
+                 (now.tv_nsec - start.tv_nsec) <
+             warmup_ns);
+}
+
+/* The smallest empty measurement is the part of every measurement that
+ * belongs to the timer rather than to the measured code.
+ */
+static void calibrate(void)
+{
+    int64_t min = INT64_MAX;
+    for (int i = 0; i < calibration_rounds; i++) {
+        int64_t start = cpucycles_start();
+        int64_t stop = cpucycles_stop();
+        if (stop - start < min)
+            min = stop - start;
+    }
+    timer_overhead = min;
+}
+
+void timer_setup(void)
+{
+    pin_cpu();
+    if (timer_ready)
+        return;
+
+    warm_up();
+    calibrate();
+    timer_ready = true;
+}
+
+void timer_finish(void)
+{
+    if (pinned) {
+        sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+        pinned = false;
+    }
+}
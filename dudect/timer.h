@@ -0,0 +1,25 @@
+#ifndef DUDECT_TIMER_H
+#define DUDECT_TIMER_H
+
+#include <stdint.h>
+#include "cpucycles.h"
+
+/* Cycles taken by an empty cpucycles_start()/cpucycles_stop() pair */
+extern int64_t timer_overhead;
+
+/* Prepare the calibrated timer: pin the process to the CPU it runs on,
+ * warm the CPU up, and measure timer_overhead.  Only the first call warms
+ * up and calibrates, so it can be called before every measurement session.
+ */
+void timer_setup(void);
+
+/* End a measurement session, letting the process run on its former CPUs */
+void timer_finish(void);
+
+/* Cycles spent between a start and a stop, corrected for the overhead */
+static inline int64_t timer_elapsed(int64_t start, int64_t stop)
+{
+    return stop - start - timer_overhead;
+}
+
+#endif
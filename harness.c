@@ -7,6 +7,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -68,8 +69,9 @@ static bool time_limited = false;
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    if (!fail_probability)
+        return false;
+    return prng_double(PRNG_FAULT) < 0.01 * fail_probability;
 }
 
 /*
@@ -231,12 +233,14 @@ size_t allocation_check()
  */
 
 /*
- * Set/unset cautious mode.
+ * Set/unset cautious mode and return the previous setting.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
-void set_cautious_mode(bool cautious)
+bool set_cautious_mode(bool cautious)
 {
+    bool was = cautious_mode;
     cautious_mode = cautious;
+    return was;
 }
 
 /*
@@ -26,10 +26,33 @@ size_t allocation_check();
 extern int fail_probability;
 
 /*
- * Set/unset cautious mode.
+ * Set/unset cautious mode and return the previous setting.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
-void set_cautious_mode(bool cautious);
+bool set_cautious_mode(bool cautious);
+
+/*
+ * Run stmt with cautious mode off, since every cautious free walks all
+ * allocated blocks, and restore the previous setting afterwards.
+ */
+#define without_cautious_mode(stmt)                 \
+    do {                                            \
+        bool __cautious = set_cautious_mode(false); \
+        stmt;                                       \
+        set_cautious_mode(__cautious);              \
+    } while (0)
+
+/*
+ * Run stmt with no allocation failing on purpose, for setup that is not
+ * under test, and restore the failure probability afterwards.
+ */
+#define without_fault_injection(stmt)  \
+    do {                               \
+        int __fail = fail_probability; \
+        fail_probability = 0;          \
+        stmt;                          \
+        fail_probability = __fail;     \
+    } while (0)
 
 /*
  * Set/unset restricted allocation mode.
@@ -0,0 +1,62 @@
+/* Log-linear histogram */
+
+#include "hist.h"
+#include <math.h>
+#include <string.h>
+
+static inline unsigned int bucket_of(uint64_t value)
+{
+    if (value < HIST_SUB_COUNT)
+        return value;
+
+    /* Drop all but the HIST_SUB_BITS bits below the leading one */
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (value >> shift) - HIST_SUB_COUNT;
+}
+
+/* Largest value that falls into bucket b */
+static inline uint64_t bucket_top(unsigned int b)
+{
+    if (b < HIST_SUB_COUNT)
+        return b;
+
+    int shift = b / HIST_SUB_COUNT - 1;
+    uint64_t low = (uint64_t) (b % HIST_SUB_COUNT + HIST_SUB_COUNT) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+void hist_reset(hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(hist_t *h, uint64_t value)
+{
+    h->counts[bucket_of(value)]++;
+    h->total++;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+uint64_t hist_percentile(const hist_t *h, double p)
+{
+    if (!h->total)
+        return 0;
+
+    uint64_t rank = (uint64_t) ceil(p / 100 * h->total);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(b);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
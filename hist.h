@@ -0,0 +1,30 @@
+#ifndef LAB0_HIST_H
+#define LAB0_HIST_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram of non-negative values, such as latencies in
+ * nanoseconds.  Values below 2^HIST_SUB_BITS are counted exactly.  Above
+ * that, every power of two is split into 2^HIST_SUB_BITS equal buckets, so
+ * that a value is known to within 1 part in 2^HIST_SUB_BITS.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min, max;
+} hist_t;
+
+void hist_reset(hist_t *h);
+void hist_record(hist_t *h, uint64_t value);
+
+/* Smallest value that at least p percent of the recorded values do not
+ * exceed, up to the bucket resolution.  Zero if nothing was recorded.
+ */
+uint64_t hist_percentile(const hist_t *h, double p);
+
+#endif /* LAB0_HIST_H */
@@ -1,6 +1,7 @@
 /* Implementation of testing code for queue code */
 
 #include <errno.h>
+#include <limits.h>
 #include <getopt.h>
 #include <signal.h>
 #include <spawn.h>
@@ -12,7 +13,9 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "dudect/complexity.h"
 #include "dudect/fixture.h"
+#include "dudect/timer.h"
 #include "list.h"
 
 
@@ -35,6 +38,7 @@
 #include "queue.h"
 
 #include "console.h"
+#include "random.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -50,6 +54,9 @@
 static int big_list_size = BIG_LIST;
 
 void q_linuxsort(struct list_head *head);
+void q_topdownsort(struct list_head *head);
+bool q_sort_reserve(size_t n);
+void q_arraysort(struct list_head *head);
 void q_shuffle(struct list_head *head);
 
 /* Global variables */
@@ -72,13 +79,37 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Seed of the generator behind random strings, shuffles and failures */
+static int seed = 0;
+
+/* Whether showing the queue checks its links and length */
+static int show_validate = 1;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
-static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
 /* Forward declarations */
 static bool show_queue(int vlevel);
 
+/* Check in simulation mode that op grows no faster than expected */
+static bool simulate_complexity(int argc,
+                                char *argv[],
+                                int op,
+                                complexity_t expected)
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+    bool ok = is_complexity_within(op, expected);
+    if (!ok) {
+        report(1, "ERROR: Probably worse than %s", complexity_name(expected));
+        return false;
+    }
+    report(1, "Probably %s or better", complexity_name(expected));
+    return ok;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -138,20 +169,24 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/*
- * TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
- */
-static void fill_rand_string(char *buf, size_t buf_size)
-{
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+/* Random strings are generated a batch at a time */
+#define RAND_BATCH 256
+static char rand_pool[RAND_BATCH][MAX_RANDSTR_LEN];
+static int rand_next = RAND_BATCH;
 
-    for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+static char *next_rand_string()
+{
+    if (rand_next == RAND_BATCH) {
+        prng_fill_lower(PRNG_WORKLOAD, rand_pool[0], sizeof(rand_pool));
+        for (int i = 0; i < RAND_BATCH; i++) {
+            size_t len =
+                MIN_RANDSTR_LEN +
+                prng_range(PRNG_WORKLOAD, MAX_RANDSTR_LEN - MIN_RANDSTR_LEN);
+            rand_pool[i][len] = '\0';
+        }
+        rand_next = 0;
     }
-    buf[len] = '\0';
+    return rand_pool[rand_next++];
 }
 
 /* insert head */
@@ -172,7 +207,6 @@ static bool do_ih(int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -190,7 +224,6 @@ static bool do_ih(int argc, char *argv[])
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
     }
 
     if (!l_meta.l)
@@ -200,8 +233,10 @@ static bool do_ih(int argc, char *argv[])
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                inserts = next_rand_string();
+            uint64_t start = now_ns();
             bool rval = q_insert_head(l_meta.l, inserts);
+            latency_record(now_ns() - start);
             if (rval) {
                 lcnt++;
                 l_meta.size++;
@@ -261,7 +296,6 @@ static bool do_it(int argc, char *argv[])
         return ok;
     }
 
-    char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -279,7 +313,6 @@ static bool do_it(int argc, char *argv[])
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
     }
 
     if (!l_meta.l)
@@ -289,8 +322,10 @@ static bool do_it(int argc, char *argv[])
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                inserts = next_rand_string();
+            uint64_t start = now_ns();
             bool rval = q_insert_tail(l_meta.l, inserts);
+            latency_record(now_ns() - start);
             if (rval) {
                 lcnt++;
                 l_meta.size++;
@@ -532,6 +567,10 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv, complexity_reverse,
+                                   complexity_n);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -553,6 +592,10 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv, complexity_size,
+                                   complexity_n);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -578,7 +621,9 @@ static bool do_size(int argc, char *argv[])
 
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
+            uint64_t start = now_ns();
             cnt = q_size(l_meta.l);
+            latency_record(now_ns() - start);
             ok = ok && !error_check();
         }
     }
@@ -600,7 +645,8 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
-bool do_sort(int argc, char *argv[])
+/* Run one of the sorts on the queue and check the result */
+static bool run_sort(int argc, char *argv[], void (*sort)(struct list_head *))
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
@@ -618,7 +664,7 @@ bool do_sort(int argc, char *argv[])
 
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_sort(l_meta.l);
+        sort(l_meta.l);
     exception_cancel();
     set_noallocate_mode(false);
 
@@ -643,48 +689,35 @@ bool do_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
-bool do_linuxsort(int argc, char *argv[])
+bool do_sort(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
-        return false;
-    }
+    if (simulation)
+        return simulate_complexity(argc, argv, complexity_sort,
+                                   complexity_n_log_n);
 
-    if (!l_meta.l)
-        report(3, "Warning: Calling sort on null queue");
-    error_check();
-
-    int cnt = q_size(l_meta.l);
-    if (cnt < 2)
-        report(3, "Warning: Calling sort on single node");
-    error_check();
+    return run_sort(argc, argv, q_sort);
+}
 
-    set_noallocate_mode(true);
-    if (exception_setup(true))
-        q_linuxsort(l_meta.l);
-    exception_cancel();
-    set_noallocate_mode(false);
+bool do_linuxsort(int argc, char *argv[])
+{
+    return run_sort(argc, argv, q_linuxsort);
+}
 
-    bool ok = true;
-    if (l_meta.size) {
-        for (struct list_head *cur_l = l_meta.l->next;
-             cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
-            /* Ensure each element in ascending order */
-            /* FIXME: add an option to specify sorting order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
-            if (strcasecmp(item->value, next_item->value) > 0) {
-                report(1, "ERROR: Not sorted in ascending order");
-                ok = false;
-                break;
-            }
-        }
-    }
+bool do_topdownsort(int argc, char *argv[])
+{
+    return run_sort(argc, argv, q_topdownsort);
+}
 
-    show_queue(3);
-    return ok && !error_check();
+bool do_arraysort(int argc, char *argv[])
+{
+    /* The array has to be allocated before sorting forbids it */
+    if (!q_sort_reserve(lcnt))
+        report(3, "Warning: No room to sort as an array, using q_sort");
+    bool ok = run_sort(argc, argv, q_arraysort);
+    q_sort_reserve(0);
+    return ok;
 }
+
 bool do_shuffle(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -715,6 +748,10 @@ bool do_shuffle(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv, complexity_delete_mid,
+                                   complexity_n);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -735,6 +772,10 @@ static bool do_dm(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_complexity(argc, argv, complexity_swap,
+                                   complexity_n);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -755,6 +796,150 @@ static bool do_swap(int argc, char *argv[])
     return !error_check();
 }
 
+/* Operations that can be measured by the bench command */
+enum { bench_ih, bench_it, bench_rh, bench_rt, bench_size, bench_number };
+static const char *bench_names[bench_number] = {"ih", "it", "rh", "rt",
+                                                "size"};
+
+static int cmp_cycles(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    int op = 0;
+    while (op < bench_number && strcmp(argv[1], bench_names[op]))
+        op++;
+    if (op == bench_number) {
+        report(1, "Unknown operation '%s'", argv[1]);
+        return false;
+    }
+
+    int reps = 1000;
+    if (argc == 3 && (!get_int(argv[2], &reps) || reps <= 0)) {
+        report(1, "Invalid number of calls '%s'", argv[2]);
+        return false;
+    }
+
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling bench on null queue");
+        return false;
+    }
+
+    int64_t *cycles = malloc(reps * sizeof(int64_t));
+    if (!cycles) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for cycles");
+        return false;
+    }
+
+    timer_setup();
+    error_check();
+
+    bool ok = true;
+    int cnt = 0;
+    if (exception_setup(true)) {
+        while (ok && cnt < reps) {
+            element_t *re = NULL;
+            bool rval = true;
+            int64_t start = 0, stop = 0;
+            if ((op == bench_rh || op == bench_rt) && !l_meta.size) {
+                report(2, "Queue became empty after %d calls", cnt);
+                break;
+            }
+
+            switch (op) {
+            case bench_ih:
+                start = cpucycles_start();
+                rval = q_insert_head(l_meta.l, "bench");
+                stop = cpucycles_stop();
+                break;
+            case bench_it:
+                start = cpucycles_start();
+                rval = q_insert_tail(l_meta.l, "bench");
+                stop = cpucycles_stop();
+                break;
+            case bench_rh:
+                start = cpucycles_start();
+                re = q_remove_head(l_meta.l, NULL, 0);
+                stop = cpucycles_stop();
+                break;
+            case bench_rt:
+                start = cpucycles_start();
+                re = q_remove_tail(l_meta.l, NULL, 0);
+                stop = cpucycles_stop();
+                break;
+            case bench_size:
+                start = cpucycles_start();
+                q_size(l_meta.l);
+                stop = cpucycles_stop();
+                break;
+            }
+
+            if (op == bench_ih || op == bench_it) {
+                if (rval) {
+                    lcnt++;
+                    l_meta.size++;
+                } else {
+                    report(1, "ERROR: Insertion of bench failed");
+                    ok = false;
+                }
+            } else if (op == bench_rh || op == bench_rt) {
+                if (re) {
+                    q_release_element(re);
+                    lcnt--;
+                    l_meta.size--;
+                } else {
+                    report(1, "ERROR: Removal from queue failed");
+                    ok = false;
+                }
+            }
+            cycles[cnt++] = timer_elapsed(start, stop);
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+    timer_finish();
+
+    if (cnt > 0) {
+        qsort(cycles, cnt, sizeof(int64_t), cmp_cycles);
+        double sum = 0;
+        for (int i = 0; i < cnt; i++)
+            sum += cycles[i];
+        report(1,
+               "%s: %d calls, cycles min %ld, median %ld, mean %.1f, "
+               "p99 %ld, max %ld",
+               argv[1], cnt, (long) cycles[0], (long) cycles[cnt / 2],
+               sum / cnt, (long) cycles[(size_t) cnt * 99 / 100],
+               (long) cycles[cnt - 1]);
+    }
+    free(cycles);
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_ctstore(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    set_const_store(argc == 2 ? argv[1] : NULL);
+    if (argc == 2)
+        report(1, "Merging constant-time statistics into '%s'", argv[1]);
+    else
+        report(1, "Not storing constant-time statistics");
+    return true;
+}
+
 static bool is_circular()
 {
     struct list_head *cur = l_meta.l->next;
@@ -773,33 +958,94 @@ static bool is_circular()
     return true;
 }
 
-static bool show_queue(int vlevel)
+/*
+ * Output of show is gathered here and handed to report in one piece, or in
+ * several when it does not fit
+ */
+#define SHOW_BUFSIZE 4096
+static char show_buf[SHOW_BUFSIZE];
+static size_t show_len = 0;
+
+static void show_append(int vlevel, const char *s)
+{
+    size_t len = strlen(s);
+    while (len) {
+        if (show_len == SHOW_BUFSIZE - 1) {
+            report_noreturn(vlevel, "%s", show_buf);
+            show_len = 0;
+        }
+        size_t n = SHOW_BUFSIZE - 1 - show_len;
+        if (n > len)
+            n = len;
+        memcpy(show_buf + show_len, s, n);
+        show_len += n;
+        show_buf[show_len] = '\0';
+        s += n;
+        len -= n;
+    }
+}
+
+static void show_end(int vlevel, const char *s)
+{
+    show_append(vlevel, s);
+    report(vlevel, "%s", show_buf);
+    show_len = 0;
+}
+
+/*
+ * Show every stride-th element with index in [start, end).  Unless
+ * validation is off, the whole queue is walked to check it against lcnt.
+ */
+static bool show_range(int vlevel, size_t start, size_t end, size_t stride)
 {
     bool ok = true;
     if (verblevel < vlevel)
         return true;
 
-    int cnt = 0;
     if (!l_meta.l) {
         report(vlevel, "l = NULL");
         return true;
     }
 
-    if (!is_circular()) {
+    if (show_validate && !is_circular()) {
         report(vlevel, "ERROR:  Queue is not doubly circular");
         return false;
     }
 
-    report_noreturn(vlevel, "l = [");
+    char label[64];
+    if (stride > 1)
+        snprintf(label, sizeof(label), "l[::%zu] = [", stride);
+    else if (start > 0 || end != (size_t) big_list_size)
+        snprintf(label, sizeof(label), "l[%zu:%zu] = [", start, end);
+    else
+        snprintf(label, sizeof(label), "l = [");
+    show_append(vlevel, label);
 
     struct list_head *ori = l_meta.l;
-    struct list_head *cur = l_meta.l->next;
+    struct list_head *cur = ori->next;
+    size_t cnt = 0;
+    if (!show_validate && start > lcnt / 2 && start < lcnt) {
+        /* Closer to the tail, so walk back to the first element shown */
+        cnt = lcnt;
+        cur = ori;
+        while (cnt > start) {
+            cur = cur->prev;
+            cnt--;
+        }
+    }
+    /* Without validation, trust lcnt and stop once past the last shown */
+    size_t stop = show_validate ? lcnt : end < lcnt ? end : lcnt;
 
+    bool first = true;
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < lcnt) {
-            element_t *e = list_entry(cur, element_t, list);
-            if (cnt < big_list_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+        while (ok && ori != cur && cnt < stop) {
+            if (cnt >= start && cnt < end && (cnt - start) % stride == 0) {
+                element_t *e = list_entry(cur, element_t, list);
+                if (!first)
+                    show_append(vlevel, " ");
+                show_append(vlevel, e->value);
+                first = false;
+            }
             cnt++;
             cur = cur->next;
             ok = ok && !error_check();
@@ -808,17 +1054,16 @@ static bool show_queue(int vlevel)
     exception_cancel();
 
     if (!ok) {
-        report(vlevel, " ... ]");
+        show_end(vlevel, " ... ]");
         return false;
     }
 
-    if (cur == ori) {
-        if (cnt <= big_list_size)
-            report(vlevel, "]");
-        else
-            report(vlevel, " ... ]");
-    } else {
-        report(vlevel, " ... ]");
+    if (!show_validate)
+        show_end(vlevel, end < lcnt ? " ... ]" : "]");
+    else if (cur == ori)
+        show_end(vlevel, cnt <= end ? "]" : " ... ]");
+    else {
+        show_end(vlevel, " ... ]");
         report(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
         ok = false;
     }
@@ -826,13 +1071,38 @@ static bool show_queue(int vlevel)
     return ok;
 }
 
+static bool show_queue(int vlevel)
+{
+    return show_range(vlevel, 0, big_list_size, 1);
+}
+
 static bool do_show(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    int start = 0, end = big_list_size, stride = 1;
+    if (argc == 3 && !strcmp(argv[1], "every")) {
+        if (!get_int(argv[2], &stride) || stride <= 0) {
+            report(1, "Invalid stride '%s'", argv[2]);
+            return false;
+        }
+        end = INT_MAX;
+    } else if (argc == 3) {
+        if (!get_int(argv[1], &start) || !get_int(argv[2], &end) ||
+            start < 0 || end < start) {
+            report(1, "Invalid range '%s %s'", argv[1], argv[2]);
+            return false;
+        }
+    } else if (argc != 1) {
+        report(1, "%s takes no arguments, a range or 'every n'", argv[0]);
         return false;
     }
-    return show_queue(0);
+    return show_range(0, start, end, stride);
+}
+
+static void reseed(int oldval)
+{
+    prng_seed((uint64_t) (unsigned int) seed);
+    /* Drop strings generated from the old seed */
+    rand_next = RAND_BATCH;
 }
 
 static void console_init()
@@ -862,7 +1132,9 @@ static void console_init()
     ADD_COMMAND(sort, "                | Sort queue in ascending order");
     ADD_COMMAND(
         size, " [n]            | Compute queue size n times (default: n == 1)");
-    ADD_COMMAND(show, "                | Show queue contents");
+    ADD_COMMAND(show,
+                " [start end]    | Show queue contents, or those with index "
+                "in [start, end), or every n-th with 'every n'");
     ADD_COMMAND(dm, "                | Delete middle node in queue");
     ADD_COMMAND(
         dedup, "                | Delete all nodes that have duplicate string");
@@ -871,15 +1143,41 @@ static void console_init()
     ADD_COMMAND(
         linuxsort,
         "                | Use Linux kernel built-in function to sort list");
+    ADD_COMMAND(arraysort,
+                "                | Sort queue as an array of pointers and "
+                "string prefixes");
+    ADD_COMMAND(topdownsort,
+                "                | Sort queue with recursive top-down merge "
+                "sort");
     ADD_COMMAND(
         shuffle,
         "                | Use Fisher and Yates algorithm to shuffle list");
+    ADD_COMMAND(bench,
+                " op [n]         | Measure cycles of n calls of op (ih, it, "
+                "rh, rt, size) (default: n == 1000)");
+    ADD_COMMAND(ctstore,
+                " [file]         | Accumulate constant-time test statistics "
+                "across runs in file (default: don't)");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("seed", &seed,
+              "Seed of random strings, shuffles and malloc failures; "
+              "setting it restarts them",
+              reseed);
+    add_param("validate", &show_validate,
+              "Walk the whole queue to check it whenever it is shown", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("sequential", &sequential_test,
+              "Stop constant-time tests once the verdict is decisive", NULL);
+    add_param("counter", &measure_counter,
+              "Counter for constant-time tests (0: tsc, 1: cycles, "
+              "2: instructions, 3: L1D misses, 4: LLC misses, "
+              "5: branch misses); read with rdpmc if allowed, else with "
+              "a system call that adds to the cache misses",
+              NULL);
 }
 
 /* Signal handlers */
@@ -888,6 +1186,7 @@ static void sigsegvhandler(int sig)
     report(1,
            "Segmentation fault occurred.  You dereferenced a NULL or invalid "
            "pointer");
+    report_flush();
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -930,9 +1229,16 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-b BFILE][-r RFILE][-m MFILE][-s SEED]"
+        "[-v VLEVEL][-l LFILE]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-b BFILE   Replay commands compiled into BFILE\n");
+    printf("\t-r RFILE   Record commands to RFILE\n");
+    printf("\t-m MFILE   Write per-command metrics to MFILE (JSON, or CSV)\n");
+    printf("\t-s SEED    Seed random workloads (default: time)\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
     exit(0);
@@ -981,12 +1287,19 @@ int main(int argc, char *argv[])
     /* To hold input file name */
     char buf[BUFSIZE];
     char *infile_name = NULL;
+    char bbuf[BUFSIZE];
+    char *binfile_name = NULL;
+    char rbuf[BUFSIZE];
+    char *recfile_name = NULL;
+    char mbuf[BUFSIZE];
+    char *metricsfile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
     int level = 4;
+    bool seeded = false;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:b:r:m:s:l:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -996,6 +1309,32 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             infile_name = buf;
             break;
+        case 'b':
+            strncpy(bbuf, optarg, BUFSIZE);
+            bbuf[BUFSIZE - 1] = '\0';
+            binfile_name = bbuf;
+            break;
+        case 'r':
+            strncpy(rbuf, optarg, BUFSIZE);
+            rbuf[BUFSIZE - 1] = '\0';
+            recfile_name = rbuf;
+            break;
+        case 'm':
+            strncpy(mbuf, optarg, BUFSIZE);
+            mbuf[BUFSIZE - 1] = '\0';
+            metricsfile_name = mbuf;
+            break;
+        case 's': {
+            char *endptr;
+            errno = 0;
+            seed = strtol(optarg, &endptr, 10);
+            if (errno != 0 || endptr == optarg) {
+                fprintf(stderr, "Invalid seed\n");
+                exit(EXIT_FAILURE);
+            }
+            seeded = true;
+            break;
+        }
         case 'v': {
             char *endptr;
             errno = 0;
@@ -1018,7 +1357,14 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
+    if (infile_name && binfile_name) {
+        fprintf(stderr, "Options -f and -b cannot be used together\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!seeded)
+        seed = (int) time(NULL);
+    reseed(0);
     queue_init();
     init_cmd();
     console_init();
@@ -1034,11 +1380,18 @@ int main(int argc, char *argv[])
     }
     if (logfile_name)
         set_logfile(logfile_name);
+    if (recfile_name && !set_record_file(recfile_name))
+        report(1, "ERROR: Could not record to '%s'", recfile_name);
+    if (metricsfile_name && !set_metrics_file(metricsfile_name))
+        report(1, "ERROR: Could not write metrics to '%s'", metricsfile_name);
 
     add_quit_helper(queue_quit);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (binfile_name)
+        ok = ok && run_binary(binfile_name);
+    else
+        ok = ok && run_console(infile_name);
     ok = ok && finish_cmd();
 
     return ok ? 0 : 1;
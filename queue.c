@@ -8,6 +8,8 @@
 
 #include "harness.h"
 #include "queue.h"
+#include "random.h"
+#include "strcmp_simd.h"
 typedef unsigned char u8;
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -119,18 +121,20 @@ bool q_insert_tail(struct list_head *head, char *s)
  */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || head->next == head)
+    if (!head)
         return NULL;
-    else {
-        struct list_head *del = head->next;
-        list_del_init(head->next);
+    /* Unlinking from an empty queue only rewrites the links of the head
+     * itself, so an empty queue takes the same path as any other.
+     */
+    struct list_head *del = head->next;
+    bool empty = del == head;
+    list_del_init(del);
+    if (sp && !empty) {
         element_t *del_ele = list_entry(del, element_t, list);
-        if (sp) {
-            strncpy(sp, del_ele->value, bufsize - 1);
-            *(sp + bufsize - 1) = '\0';
-        }
-        return del_ele;
+        strncpy(sp, del_ele->value, bufsize - 1);
+        *(sp + bufsize - 1) = '\0';
     }
+    return empty ? NULL : list_entry(del, element_t, list);
 }
 
 /*
@@ -139,18 +143,17 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || head->next == head)
+    if (!head)
         return NULL;
-    else {
-        struct list_head *del = head->prev;
-        list_del_init(head->prev);
+    struct list_head *del = head->prev;
+    bool empty = del == head;
+    list_del_init(del);
+    if (sp && !empty) {
         element_t *del_ele = list_entry(del, element_t, list);
-        if (sp) {
-            strncpy(sp, del_ele->value, bufsize - 1);
-            *(sp + bufsize - 1) = '\0';
-        }
-        return del_ele;
+        strncpy(sp, del_ele->value, bufsize - 1);
+        *(sp + bufsize - 1) = '\0';
     }
+    return empty ? NULL : list_entry(del, element_t, list);
 }
 
 /*
@@ -225,7 +228,7 @@ bool q_delete_dup(struct list_head *head)
         // if &safe->list == head, safe->value will dereference a null pointer
         if (&safe->list != head) {
             if (node->value && safe->value) {
-                if (!strcmp(node->value, safe->value)) {
+                if (str_equal(node->value, safe->value)) {
                     list_del(&node->list);
                     q_release_element(node);
                 }
@@ -287,8 +290,8 @@ struct list_head *mergeTwoLists(struct list_head *L1, struct list_head *L2)
     struct list_head *head = NULL, **ptr = &head, **node;
 
     for (node = NULL; L1 && L2; *node = (*node)->next) {
-        node = (strcmp(list_entry(L1, element_t, list)->value,
-                       list_entry(L2, element_t, list)->value) < 0)
+        node = (str_compare(list_entry(L1, element_t, list)->value,
+                            list_entry(L2, element_t, list)->value) < 0)
                    ? &L1
                    : &L2;
         *ptr = *node;
@@ -316,12 +319,8 @@ static struct list_head *mergesort(struct list_head *head)
     return mergeTwoLists(left, right);
 }
 
-/*
- * Sort elements of queue in ascending order
- * No effect if q is NULL or empty. In addition, if q has only one
- * element, do nothing.
- */
-void q_sort(struct list_head *head)
+/* Top-down merge sort, splitting each sublist at its midpoint */
+void q_topdownsort(struct list_head *head)
 {
     if (!head || head->next == head || head->next->next == head)
         return;
@@ -347,8 +346,8 @@ static struct list_head *merge(void *priv,
 
     for (;;) {
         /* if equal, take 'a' -- important for sort stability */
-        if (strcmp(list_entry(a, element_t, list)->value,
-                   list_entry(b, element_t, list)->value) <= 0) {
+        if (str_compare(list_entry(a, element_t, list)->value,
+                        list_entry(b, element_t, list)->value) <= 0) {
             *tail = a;
             tail = &a->next;
             a = a->next;
@@ -380,8 +379,8 @@ static void merge_final(void *priv,
 
     for (;;) {
         /* if equal, take 'a' -- important for sort stability */
-        if (strcmp(list_entry(a, element_t, list)->value,
-                   list_entry(b, element_t, list)->value) <= 0) {
+        if (str_compare(list_entry(a, element_t, list)->value,
+                        list_entry(b, element_t, list)->value) <= 0) {
             tail->next = a;
             a->prev = tail;
             tail = a;
@@ -476,6 +475,249 @@ void list_sort(void *priv, struct list_head *head)
 
 
 
+/*
+ * Sort elements of queue in ascending order
+ * No effect if q is NULL or empty. In addition, if q has only one
+ * element, do nothing.
+ *
+ * Bottom-up merge sort: run[k] holds a sorted run of 2^k elements, and two
+ * runs of the same size are merged as soon as the second one is complete.
+ * Merges thus happen depth first, on elements that were just touched, and
+ * those small enough to fit in the cache never leave it.  Unlike the
+ * top-down sort, nothing recurses and no sublist is walked to find its
+ * midpoint.
+ *
+ * This is already the batching of a cache-sized first pass: each batch of
+ * 2^k elements is sorted completely, with no merge touching anything else,
+ * before the next batch is read, so a first pass over batches sized to the
+ * L2 cache would do the same merges in the same order.
+ */
+void q_sort(struct list_head *head)
+{
+    struct list_head *run[64] = {NULL};
+    int top = 0;
+
+    if (!head || head->next == head || head->next->next == head)
+        return;
+
+    /* Convert to a null-terminated singly-linked list. */
+    struct list_head *list = head->next;
+    head->prev->next = NULL;
+    while (list) {
+        struct list_head *cur = list;
+        list = list->next;
+        cur->next = NULL;
+
+        /* Carry the new element up like an increment of a binary counter */
+        int k;
+        for (k = 0; run[k]; k++) {
+            cur = merge(NULL, run[k], cur);
+            run[k] = NULL;
+        }
+        run[k] = cur;
+        if (k > top)
+            top = k;
+    }
+
+    /* Merge what is left, younger runs into older ones for stability */
+    list = NULL;
+    for (int k = 0; k < top; k++) {
+        if (run[k])
+            list = list ? merge(NULL, run[k], list) : run[k];
+    }
+    if (list) {
+        merge_final(NULL, head, run[top], list);
+        return;
+    }
+
+    /* The size is a power of two, and run[top] holds everything */
+    struct list_head *prev = head;
+    for (list = run[top]; list; list = list->next) {
+        prev->next = list;
+        list->prev = prev;
+        prev = list;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+/*
+ * Array sort: the elements are gathered into a contiguous array along with
+ * the first eight bytes of their strings, packed big-endian so that they
+ * compare as integers in the order of strcmp.  Most comparisons are thus
+ * settled without touching the strings, and the array is sorted with an
+ * introsort before the list is relinked in one pass.
+ *
+ * The harness forbids allocation while sorting, so the array is set aside
+ * beforehand by q_sort_reserve.
+ */
+typedef struct {
+    uint64_t prefix;
+    element_t *e;
+} sort_entry_t;
+
+static sort_entry_t *sort_array = NULL;
+static size_t sort_capacity = 0;
+
+/* Make room to array sort n elements, or release the room if n is 0 */
+bool q_sort_reserve(size_t n)
+{
+    if (n <= sort_capacity && n)
+        return true;
+
+    free(sort_array);
+    sort_array = NULL;
+    sort_capacity = 0;
+    if (!n)
+        return true;
+
+    sort_array = malloc(n * sizeof(sort_entry_t));
+    if (!sort_array)
+        return false;
+    sort_capacity = n;
+    return true;
+}
+
+static inline bool entry_less(const sort_entry_t *a, const sort_entry_t *b)
+{
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix;
+    /* Equal prefixes ending in NUL mean equal strings */
+    if (!(a->prefix & 0xff))
+        return false;
+    return str_compare(a->e->value + 8, b->e->value + 8) < 0;
+}
+
+static inline void entry_swap(sort_entry_t *a, sort_entry_t *b)
+{
+    sort_entry_t t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void insertion_sort(sort_entry_t *a, size_t n)
+{
+    for (size_t i = 1; i < n; i++) {
+        sort_entry_t t = a[i];
+        size_t j = i;
+        for (; j > 0 && entry_less(&t, &a[j - 1]); j--)
+            a[j] = a[j - 1];
+        a[j] = t;
+    }
+}
+
+static void sift_down(sort_entry_t *a, size_t i, size_t n)
+{
+    for (size_t c; (c = 2 * i + 1) < n; i = c) {
+        if (c + 1 < n && entry_less(&a[c], &a[c + 1]))
+            c++;
+        if (!entry_less(&a[i], &a[c]))
+            break;
+        entry_swap(&a[i], &a[c]);
+    }
+}
+
+static void heap_sort(sort_entry_t *a, size_t n)
+{
+    for (size_t i = n / 2; i-- > 0;)
+        sift_down(a, i, n);
+    for (size_t i = n; i-- > 1;) {
+        entry_swap(&a[0], &a[i]);
+        sift_down(a, 0, i);
+    }
+}
+
+/* Quicksort, turning to heapsort when the partitions stay unbalanced */
+static void intro_sort(sort_entry_t *a, size_t n, int depth)
+{
+    while (n > 16) {
+        if (!depth--) {
+            heap_sort(a, n);
+            return;
+        }
+
+        /* Median of three as pivot, left at a[0] */
+        size_t m = n / 2;
+        if (entry_less(&a[m], &a[0]))
+            entry_swap(&a[m], &a[0]);
+        if (entry_less(&a[n - 1], &a[m]))
+            entry_swap(&a[n - 1], &a[m]);
+        if (entry_less(&a[m], &a[0]))
+            entry_swap(&a[m], &a[0]);
+        entry_swap(&a[0], &a[m]);
+
+        /* Hoare partition around a[0] */
+        size_t i = 0, j = n;
+        for (;;) {
+            while (entry_less(&a[++i], &a[0]))
+                if (i == n - 1)
+                    break;
+            while (entry_less(&a[0], &a[--j]))
+                ;
+            if (i >= j)
+                break;
+            entry_swap(&a[i], &a[j]);
+        }
+        entry_swap(&a[0], &a[j]);
+
+        /* Recurse into the smaller side, loop on the larger one */
+        if (j < n - j - 1) {
+            intro_sort(a, j, depth);
+            a += j + 1;
+            n -= j + 1;
+        } else {
+            intro_sort(a + j + 1, n - j - 1, depth);
+            n = j;
+        }
+    }
+    insertion_sort(a, n);
+}
+
+/*
+ * Sort the queue through the array set aside by q_sort_reserve, or with
+ * q_sort if it is too small
+ */
+void q_arraysort(struct list_head *head)
+{
+    if (!head || head->next == head || head->next->next == head)
+        return;
+
+    size_t n = 0;
+    struct list_head *node;
+    list_for_each (node, head) {
+        if (n == sort_capacity) {
+            q_sort(head);
+            return;
+        }
+        element_t *e = list_entry(node, element_t, list);
+        uint64_t prefix = 0;
+        const char *s = e->value;
+        for (int i = 0; i < 8; i++) {
+            prefix = prefix << 8 | (unsigned char) *s;
+            if (*s)
+                s++;
+        }
+        sort_array[n].prefix = prefix;
+        sort_array[n].e = e;
+        n++;
+    }
+
+    int depth = 0;
+    for (size_t m = n; m; m >>= 1)
+        depth += 2;
+    intro_sort(sort_array, n, depth);
+
+    struct list_head *prev = head;
+    for (size_t i = 0; i < n; i++) {
+        node = &sort_array[i].e->list;
+        prev->next = node;
+        node->prev = prev;
+        prev = node;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
 void q_linuxsort(struct list_head *head)
 {
     list_sort(0, head);
@@ -485,7 +727,7 @@ void q_shuffle(struct list_head *head)
 {
     struct list_head *select = head;
     for (int size = q_size(head), rnd; size > 0; size--) {
-        rnd = rand() % size + 1;
+        rnd = prng_range(PRNG_SHUFFLE, size) + 1;
         do {
             select = select->next;
             rnd--;
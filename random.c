@@ -1,39 +1,181 @@
 #include "random.h"
-#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/random.h>
 #include <unistd.h>
 
-/* shameless stolen from ebacs */
-void randombytes(uint8_t *x, size_t how_much)
+#include "report.h"
+
+/* Read from /dev/urandom, for kernels without getrandom().  Give up after
+ * URANDOM_TRIES failures in a row, a second apart.
+ * shameless stolen from ebacs
+ */
+#define URANDOM_TRIES 5
+
+static void urandom_bytes(uint8_t *x, size_t xlen)
 {
     ssize_t i;
     static int fd = -1;
+    int tries = 0;
 
-    ssize_t xlen = (ssize_t) how_much;
-    assert(xlen >= 0);
-    if (fd == -1) {
-        for (;;) {
-            fd = open("/dev/urandom", O_RDONLY);
-            if (fd != -1)
-                break;
-            sleep(1);
-        }
+    while (fd == -1) {
+        fd = open("/dev/urandom", O_RDONLY);
+        if (fd != -1)
+            break;
+        if (++tries == URANDOM_TRIES)
+            report_event(MSG_FATAL, "Could not open /dev/urandom: %s",
+                         strerror(errno));
+        sleep(1);
     }
 
+    tries = 0;
     while (xlen > 0) {
-        if (xlen < 1048576)
-            i = xlen;
-        else
-            i = 1048576;
-
-        i = read(fd, x, (size_t) i);
+        i = read(fd, x, xlen < 1048576 ? xlen : 1048576);
         if (i < 1) {
+            if (i < 0 && errno == EINTR)
+                continue;
+            if (++tries == URANDOM_TRIES)
+                report_event(MSG_FATAL, "Could not read /dev/urandom: %s",
+                             i ? strerror(errno) : "end of file");
             sleep(1);
             continue;
         }
 
+        tries = 0;
+        x += i;
+        xlen -= i;
+    }
+}
+
+static void entropy_bytes(uint8_t *x, size_t xlen)
+{
+    while (xlen > 0) {
+        ssize_t i = getrandom(x, xlen, 0);
+        if (i < 0) {
+            if (errno == EINTR)
+                continue;
+            urandom_bytes(x, xlen);
+            return;
+        }
+
         x += i;
         xlen -= i;
     }
 }
+
+/*
+ * Small requests are served from a buffer of each thread, refilled with a
+ * single getrandom() call when it runs dry.
+ */
+#define POOL_SIZE 4096
+static __thread uint8_t pool[POOL_SIZE];
+static __thread size_t pool_used = POOL_SIZE;
+
+/* Bits left over from the last word randombit() took from the pool */
+static __thread uint64_t bits;
+static __thread int bits_left = 0;
+
+void randombytes(uint8_t *x, size_t how_much)
+{
+    if (how_much >= POOL_SIZE) {
+        entropy_bytes(x, how_much);
+        return;
+    }
+
+    while (how_much > 0) {
+        if (pool_used == POOL_SIZE) {
+            entropy_bytes(pool, POOL_SIZE);
+            pool_used = 0;
+        }
+
+        size_t n = POOL_SIZE - pool_used;
+        if (n > how_much)
+            n = how_much;
+        memcpy(x, pool + pool_used, n);
+        pool_used += n;
+        x += n;
+        how_much -= n;
+    }
+}
+
+uint8_t randombit(void)
+{
+    if (!bits_left) {
+        randombytes((uint8_t *) &bits, sizeof(bits));
+        bits_left = 64;
+    }
+
+    uint8_t ret = bits & 1;
+    bits >>= 1;
+    bits_left--;
+    return ret;
+}
+
+uint64_t prng_state[PRNG_STREAMS][4];
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Draws are split into 16-bit lanes, each scaled to a letter by a multiply
+ * and a shift, which leaves a bias below 2^-11 and compiles to vector code.
+ */
+void prng_fill_lower(prng_stream_t stream, char *buf, size_t len)
+{
+    uint16_t lanes[64];
+    /* Work on a copy, which buf cannot alias */
+    uint64_t s[4];
+    memcpy(s, prng_state[stream], sizeof(s));
+
+    while (len) {
+        size_t n = len < 64 ? len : 64;
+        for (size_t i = 0; i < (n + 3) / 4; i++) {
+            uint64_t x = prng_step(s);
+            memcpy(&lanes[4 * i], &x, sizeof(x));
+        }
+        for (size_t i = 0; i < n; i++)
+            buf[i] = 'a' + (char) ((lanes[i] * 26u) >> 16);
+        buf += n;
+        len -= n;
+    }
+    memcpy(prng_state[stream], s, sizeof(s));
+}
+
+/* Advance a stream by 2^128 steps */
+static void prng_jump(uint64_t s[4])
+{
+    static const uint64_t jump[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                    0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+    uint64_t t[4] = {0, 0, 0, 0};
+
+    for (size_t i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & (uint64_t) 1 << b) {
+                for (size_t j = 0; j < 4; j++)
+                    t[j] ^= s[j];
+            }
+            (void) prng_step(s);
+        }
+    }
+    for (size_t j = 0; j < 4; j++)
+        s[j] = t[j];
+}
+
+void prng_seed(uint64_t seed)
+{
+    uint64_t x = seed;
+    for (size_t j = 0; j < 4; j++)
+        prng_state[0][j] = splitmix64(&x);
+    for (size_t i = 1; i < PRNG_STREAMS; i++) {
+        for (size_t j = 0; j < 4; j++)
+            prng_state[i][j] = prng_state[i - 1][j];
+        prng_jump(prng_state[i]);
+    }
+}
@@ -4,13 +4,71 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Bytes from the kernel's entropy source, through a buffer, for the inputs
+ * of the constant-time test that must not be repeatable
+ */
 void randombytes(uint8_t *x, size_t xlen);
 
-static inline uint8_t randombit(void)
+/* One bit, taken from a word of randombytes() that later calls share */
+uint8_t randombit(void);
+
+/*
+ * Seeded generator (xoshiro256**) for workloads that must be reproducible.
+ * Each purpose draws from a stream of its own, 2^128 steps apart from the
+ * others, so that e.g. failing allocations do not change the strings
+ * inserted afterwards.
+ */
+typedef enum {
+    PRNG_WORKLOAD, /* Random strings */
+    PRNG_SHUFFLE,  /* q_shuffle */
+    PRNG_FAULT,    /* Failing allocations in the harness */
+    PRNG_REPLAY,   /* Arrival times of replayed commands */
+    PRNG_MEASURE,  /* Strings of the complexity and constant-time tests */
+    PRNG_STREAMS,
+} prng_stream_t;
+
+extern uint64_t prng_state[PRNG_STREAMS][4];
+
+void prng_seed(uint64_t seed);
+
+static inline uint64_t prng_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Step the state s and return its output */
+static inline uint64_t prng_step(uint64_t s[4])
+{
+    uint64_t result = prng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = prng_rotl(s[3], 45);
+    return result;
+}
+
+static inline uint64_t prng_next(prng_stream_t stream)
+{
+    return prng_step(prng_state[stream]);
+}
+
+/* Uniform in [0, n), by multiplying rather than by taking a remainder */
+static inline uint32_t prng_range(prng_stream_t stream, uint32_t n)
+{
+    return (uint32_t) (((prng_next(stream) >> 32) * n) >> 32);
+}
+
+/* Fill buf with len random lowercase letters */
+void prng_fill_lower(prng_stream_t stream, char *buf, size_t len);
+
+/* Uniform in [0, 1) */
+static inline double prng_double(prng_stream_t stream)
 {
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
+    return (prng_next(stream) >> 11) * 0x1.0p-53;
 }
 
 #endif
@@ -1,6 +1,8 @@
+#include <inttypes.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +19,12 @@ static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
 
+/* Metrics file, and the harness block count after the last command */
+static FILE *metricsfile = NULL;
+static bool metrics_csv = false;
+static size_t metrics_rows = 0;
+static size_t metrics_blocks = 0;
+
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
 {
@@ -68,7 +76,6 @@ void report_event(message_t msg, char *fmt, ...)
     fprintf(errfile, "%s: ", msg_name);
     vfprintf(errfile, fmt, ap);
     fprintf(errfile, "\n");
-    fflush(errfile);
     va_end(ap);
 
     if (logfile) {
@@ -76,14 +83,16 @@ void report_event(message_t msg, char *fmt, ...)
         fprintf(logfile, "Error: ");
         vfprintf(logfile, fmt, ap);
         fprintf(logfile, "\n");
-        fflush(logfile);
         va_end(ap);
-        fclose(logfile);
     }
 
     if (fatal) {
+        report_flush();
         if (fatal_fun)
             fatal_fun();
+        if (logfile)
+            fclose(logfile);
+        close_metrics_file(metrics_blocks);
         exit(1);
     }
 }
@@ -98,14 +107,12 @@ void report(int level, char *fmt, ...)
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
         fprintf(verbfile, "\n");
-        fflush(verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
             fprintf(logfile, "\n");
-            fflush(logfile);
             va_end(ap);
         }
     }
@@ -120,18 +127,26 @@ void report_noreturn(int level, char *fmt, ...)
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
-            fflush(logfile);
             va_end(ap);
         }
     }
 }
 
+void report_flush()
+{
+    if (verbfile)
+        fflush(verbfile);
+    if (errfile && errfile != verbfile)
+        fflush(errfile);
+    if (logfile)
+        fflush(logfile);
+}
+
 /* Functions denoting failures */
 
 /* Need to be able to print without using malloc */
@@ -140,7 +155,8 @@ static void fail_fun(char *format, char *msg)
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
-    /* Use write to avoid any buffering issues */
+    /* Use write to avoid any buffering issues, after what is buffered */
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
     if (logfile) {
@@ -154,6 +170,7 @@ static void fail_fun(char *format, char *msg)
     if (logfile)
         fclose(logfile);
 
+    close_metrics_file(metrics_blocks);
     exit(1);
 }
 
@@ -272,6 +289,91 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+/*
+ * Metrics are written one row per command, either as a JSON document or,
+ * when the file name ends in ".csv", as comma separated values.  A row has
+ * the change in the number of allocated blocks as blocks_delta, while the
+ * totals that closing the file appends to the JSON document have the
+ * number of blocks still allocated.
+ */
+
+bool set_metrics_file(char *file_name)
+{
+    close_metrics_file(metrics_blocks);
+    metricsfile = fopen(file_name, "w");
+    if (!metricsfile)
+        return false;
+
+    size_t len = strlen(file_name);
+    metrics_csv = len >= 4 && !strcmp(file_name + len - 4, ".csv");
+    metrics_rows = 0;
+    if (metrics_csv)
+        fprintf(metricsfile,
+                "seq,cmd,ok,wall_ns,allocs,frees,peak_bytes,blocks_delta\n");
+    else
+        fprintf(metricsfile, "{\"commands\": [");
+    return true;
+}
+
+bool metrics_enabled()
+{
+    return metricsfile != NULL;
+}
+
+void metrics_start(metrics_mark_t *mark, size_t blocks)
+{
+    mark->allocate_cnt = allocate_cnt;
+    mark->free_cnt = free_cnt;
+    mark->blocks = blocks;
+}
+
+void metrics_finish(const metrics_mark_t *mark,
+                    const char *cmd,
+                    bool ok,
+                    uint64_t wall_ns,
+                    size_t blocks)
+{
+    if (!metricsfile)
+        return;
+
+    size_t allocs = allocate_cnt - mark->allocate_cnt;
+    size_t frees = free_cnt - mark->free_cnt;
+    long delta = (long) blocks - (long) mark->blocks;
+    metrics_rows++;
+    metrics_blocks = blocks;
+    if (metrics_csv)
+        fprintf(metricsfile, "%zu,%s,%d,%" PRIu64 ",%zu,%zu,%zu,%ld\n",
+                metrics_rows, cmd, ok, wall_ns, allocs, frees, peak_bytes,
+                delta);
+    else
+        fprintf(metricsfile,
+                "%s\n  {\"seq\": %zu, \"cmd\": \"%s\", \"ok\": %s, "
+                "\"wall_ns\": %" PRIu64
+                ", \"allocs\": %zu, \"frees\": %zu, "
+                "\"peak_bytes\": %zu, \"blocks_delta\": %ld}",
+                metrics_rows > 1 ? "," : "", metrics_rows, cmd,
+                ok ? "true" : "false", wall_ns, allocs, frees, peak_bytes,
+                delta);
+}
+
+void close_metrics_file(size_t blocks)
+{
+    if (!metricsfile)
+        return;
+
+    if (!metrics_csv)
+        fprintf(metricsfile,
+                "\n],\n\"totals\": {\"commands\": %zu, "
+                "\"allocate_cnt\": %zu, \"allocate_bytes\": %zu, "
+                "\"free_cnt\": %zu, \"free_bytes\": %zu, "
+                "\"peak_bytes\": %zu, \"current_bytes\": %zu, "
+                "\"blocks\": %zu}}\n",
+                metrics_rows, allocate_cnt, allocate_bytes, free_cnt,
+                free_bytes, peak_bytes, current_bytes, blocks);
+    fclose(metricsfile);
+    metricsfile = NULL;
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
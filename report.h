@@ -3,6 +3,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* Default reporting level.  Must recompile when change */
 #ifndef RPT
@@ -31,6 +33,12 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/*
+ * Messages are buffered rather than flushed one by one.  Flush them before
+ * waiting for input, and before writing to the output by other means.
+ */
+void report_flush();
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
 
@@ -49,6 +57,32 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/** Machine-readable metrics.  **/
+
+/* Counters taken when a command starts */
+typedef struct {
+    size_t allocate_cnt;
+    size_t free_cnt;
+    size_t blocks; /* Blocks allocated through the harness */
+} metrics_mark_t;
+
+/* Write metrics to file, as CSV if its name ends in .csv and JSON otherwise */
+bool set_metrics_file(char *file_name);
+
+bool metrics_enabled();
+
+void metrics_start(metrics_mark_t *mark, size_t blocks);
+
+/* Write a row for a command that started at mark */
+void metrics_finish(const metrics_mark_t *mark,
+                    const char *cmd,
+                    bool ok,
+                    uint64_t wall_ns,
+                    size_t blocks);
+
+/* Write the totals, with blocks still allocated, and close the file */
+void close_metrics_file(size_t blocks);
+
 /** Time measurement.  **/
 
 /* Time counted as fp number in seconds */
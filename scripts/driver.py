@@ -4,6 +4,12 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import json
+import os
+import shutil
+import tempfile
+import time
+from multiprocessing.pool import ThreadPool
 
 
 
@@ -17,6 +23,11 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    jobs = 1
+    baseline = None
+    saveFile = None
+    threshold = 10.0
+    metrics = False
 
     traceDict = {
         1: "trace-01-ops",
@@ -35,7 +46,8 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-compile"
     }
 
     traceProbs = {
@@ -55,10 +67,15 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    # Traces worth 0 points are not graded, but must still pass
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 0]
+
+    # Differences in wall time below this many seconds are noise
+    minWallDelta = 0.05
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -69,33 +86,122 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 jobs=1,
+                 baseline=None,
+                 saveFile=None,
+                 threshold=10.0,
+                 metrics=False):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.jobs = jobs
+        self.baseline = baseline
+        self.saveFile = saveFile
+        self.metrics = metrics
+        self.threshold = threshold
 
     def printInColor(self, text, color):
         if self.colored == False:
             color = self.WHITE
         print(color, text, self.WHITE, sep = '')
 
+    # Run a trace in a directory of its own, so that concurrent runs do not
+    # share files such as the command history.  qtest insists on finding the
+    # git workspace there, which a symlink provides, and traces refer to
+    # the trace directory as traces/.  Return whether the trace passed and
+    # what it cost.
     def runTrace(self, tid):
         if not tid in self.traceDict:
             self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
-            return False
-        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
+            return False, None, ""
+        fname = os.path.abspath("%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid]))
         vname = "%d" % self.verbLevel
+        workdir = tempfile.mkdtemp(prefix="qtest-")
+        os.symlink(os.path.abspath(".git"), os.path.join(workdir, ".git"))
+        os.symlink(os.path.abspath(self.traceDirectory),
+                   os.path.join(workdir, "traces"))
+        mname = os.path.join(workdir, "metrics.json")
         clist = self.command + ["-v", vname, "-f", fname]
+        if self.metrics:
+            clist += ["-m", mname]
+        # valgrind flags the vector string compare reading past the NUL
+        env = None
+        if self.useValgrind:
+            env = dict(os.environ, QTEST_STRCMP="scalar")
 
+        # Output is kept apart when traces run concurrently
+        out = None
+        if self.jobs > 1:
+            out = tempfile.TemporaryFile(dir=workdir)
         try:
-            retcode = subprocess.call(clist)
+            start = time.monotonic()
+            p = subprocess.Popen(clist, cwd=workdir, env=env, stdout=out,
+                                 stderr=out)
+            # Reap this child alone, so that its usage is not mixed with
+            # that of other traces running at once
+            _, status, usage = os.wait4(p.pid, 0)
+            wall = time.monotonic() - start
         except Exception as e:
             self.printInColor("Call of '%s' failed: %s" % (" ".join(clist), e), self.RED)
-            return False
-        return retcode == 0
+            shutil.rmtree(workdir, ignore_errors=True)
+            return False, None, ""
+
+        text = ""
+        if out:
+            out.seek(0)
+            text = out.read().decode(errors="replace")
+            out.close()
+        # A qtest killed by a signal fails the trace
+        if os.WIFEXITED(status):
+            p.returncode = os.WEXITSTATUS(status)
+        else:
+            p.returncode = -1
+        cpu = usage.ru_utime + usage.ru_stime
+        stats = {"wall": wall, "cpu": cpu, "maxrss_kb": usage.ru_maxrss}
+        if self.metrics:
+            try:
+                with open(mname) as f:
+                    totals = json.load(f)["totals"]
+                stats["peak_bytes"] = totals["peak_bytes"]
+                stats["allocate_cnt"] = totals["allocate_cnt"]
+            except (IOError, ValueError, KeyError):
+                # qtest died before it could write the totals
+                pass
+        shutil.rmtree(workdir, ignore_errors=True)
+        return p.returncode == 0, stats, text
+
+    def relDelta(self, new, old):
+        if not old:
+            return 0.0
+        return 100.0 * (new - old) / old
+
+    # Print how each trace compares with the baseline and return the names
+    # of those that got slower or bigger by more than the threshold
+    def compare(self, results):
+        regressions = []
+        print("---\tTrace\t\t\tWall(s)\tBase\tDelta\tRSS(MB)\tBase\tDelta")
+        for tname, stats in results:
+            base = self.baseline.get(tname)
+            if not stats or not base:
+                continue
+            dwall = self.relDelta(stats["wall"], base["wall"])
+            drss = self.relDelta(stats["maxrss_kb"], base["maxrss_kb"])
+            slower = dwall > self.threshold and \
+                stats["wall"] - base["wall"] > self.minWallDelta
+            bigger = drss > self.threshold
+            line = "---\t%-20s\t%.3f\t%.3f\t%+.1f%%\t%.1f\t%.1f\t%+.1f%%" % (
+                tname, stats["wall"], base["wall"], dwall,
+                stats["maxrss_kb"] / 1024.0, base["maxrss_kb"] / 1024.0, drss)
+            if slower or bigger:
+                regressions.append(tname)
+                self.printInColor(line + "\tREGRESSION", self.RED)
+            else:
+                print(line)
+        return regressions
 
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
@@ -109,28 +215,50 @@ class Tracer:
             tidList = [tid]
         score = 0
         maxscore = 0
+        failed = False
         if self.useValgrind:
-            self.command = ['valgrind', self.qtest]
+            self.command = ['valgrind', os.path.abspath(self.qtest)]
         else:
-            self.command = [self.qtest]
-        for t in tidList:
+            self.command = [os.path.abspath(self.qtest)]
+        tidList = list(tidList)
+        pool = None
+        if self.jobs > 1:
+            pool = ThreadPool(self.jobs)
+            pending = [pool.apply_async(self.runTrace, (t,)) for t in tidList]
+        results = []
+        for i, t in enumerate(tidList):
             tname = self.traceDict[t]
             if self.verbLevel > 0:
                 print("+++ TESTING trace %s:" % tname)
-            ok = self.runTrace(t)
+            if pool:
+                ok, stats, text = pending[i].get()
+                print(text, end="")
+            else:
+                ok, stats, text = self.runTrace(t)
+            results.append((tname, stats))
             maxval = self.maxScores[t]
             tval = maxval if ok else 0
-            if tval < maxval:
+            failed = failed or not ok
+            if not ok:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.RED)
             else:
                 self.printInColor("---\t%s\t%d/%d" % (tname, tval, maxval), self.GREEN)
             score += tval
             maxscore += maxval
             scoreDict[t] = tval
-        if score < maxscore:
+        if pool:
+            pool.close()
+            pool.join()
+        if failed:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.RED)
         else:
             self.printInColor("---\tTOTAL\t\t%d/%d" % (score, maxscore), self.GREEN)
+        regressions = []
+        if self.baseline is not None:
+            regressions = self.compare(results)
+        if self.saveFile:
+            with open(self.saveFile, "w") as f:
+                json.dump({k: v for k, v in results if v}, f, indent=2, sort_keys=True)
         if self.autograde:
             # Generate JSON string
             jstring = '{"scores": {'
@@ -142,16 +270,22 @@ class Tracer:
                 jstring += '"%s" : %d' % (self.traceProbs[k], scoreDict[k])
             jstring += '}}'
             print(jstring)
-        if score < maxscore:
+        if failed or regressions:
             sys.exit(1)
 
 def usage(name):
     print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("          [-j JOBS] [-b BASELINE] [-s SAVE] [-r PCT] [-m]")
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  -j JOBS   Run up to JOBS traces at once (perf traces may suffer)")
+    print("  -b BASELINE Compare wall time and max RSS with results in BASELINE")
+    print("  -s SAVE   Save wall time, CPU time, max RSS and metrics of each trace in SAVE")
+    print("  -r PCT    Report a regression when worse than baseline by PCT% (default 10)")
+    print("  -m        Collect the allocation metrics of qtest for each trace")
     sys.exit(0)
 
 
@@ -163,8 +297,13 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    jobs = 1
+    baseline = None
+    saveFile = None
+    threshold = 10.0
+    metrics = False
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(args, 'hp:t:v:A:cj:b:s:r:m', ['valgrind'])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,6 +320,17 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '-j':
+            jobs = max(1, int(val))
+        elif opt == '-b':
+            with open(val) as f:
+                baseline = json.load(f)
+        elif opt == '-s':
+            saveFile = val
+        elif opt == '-r':
+            threshold = float(val)
+        elif opt == '-m':
+            metrics = True
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
@@ -190,7 +340,12 @@ def run(name, args):
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               jobs=jobs,
+               baseline=baseline,
+               saveFile=saveFile,
+               threshold=threshold,
+               metrics=metrics)
     t.run(tid)
 
 
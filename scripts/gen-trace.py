@@ -0,0 +1,317 @@
+#!/usr/bin/env python3
+
+# Generate families of performance traces for qtest.
+#
+# For each queue size of a sweep, a trace fills a new queue to that size,
+# runs a fixed number of operations drawn from a mix, and then runs whole
+# queue operations such as reverse and sort.  Removals name the value they
+# expect, so qtest checks the results while it runs the trace.  A manifest
+# records the parameters, the command counts and the expected final state
+# of every trace.
+
+from __future__ import print_function
+import collections
+import getopt
+import json
+import math
+import os
+import random
+import sys
+
+LETTERS = "abcdefghijklmnopqrstuvwxyz"
+
+# Operations that may appear in a mix, and those that run on the whole queue
+MIX_OPS = ["ih", "it", "rh", "rt", "size"]
+FINAL_OPS = ["reverse", "sort", "dedup"]
+
+
+class Keys:
+    """Strings inserted into the queue, identified by creation order.
+
+    Each key is a pseudo-random prefix followed by its number written in base
+    26 with a fixed width, which keeps keys of any length distinct.  Reused
+    keys are drawn from a Zipf distribution over creation rank.
+    """
+
+    def __init__(self, rng, maxKeys, minLen, maxLen, dupRatio, zipf):
+        self.rng = rng
+        self.width = 1
+        while 26**self.width < maxKeys:
+            self.width += 1
+        self.minLen = max(minLen, self.width)
+        self.maxLen = max(maxLen, self.minLen)
+        self.dupRatio = dupRatio
+        self.zipf = zipf
+        self.strings = []
+
+    def make(self, kid):
+        digits = []
+        for _ in range(self.width):
+            kid, d = divmod(kid, 26)
+            digits.append(LETTERS[d])
+        length = self.rng.randint(self.minLen, self.maxLen)
+        prefix = [self.rng.choice(LETTERS) for _ in range(length - self.width)]
+        return "".join(prefix) + "".join(reversed(digits))
+
+    # Continuous approximation of the inverse Zipf CDF over ranks [0, n)
+    def zipfRank(self, n):
+        u = self.rng.random()
+        s = self.zipf
+        if s <= 0:
+            return int(u * n)
+        if abs(s - 1.0) < 1e-9:
+            r = n**u
+        else:
+            r = ((n**(1.0 - s) - 1.0) * u + 1.0)**(1.0 / (1.0 - s))
+        return min(n - 1, int(r) - 1) if r >= 1 else 0
+
+    def next(self):
+        n = len(self.strings)
+        if n and self.rng.random() < self.dupRatio:
+            return self.zipfRank(n)
+        self.strings.append(self.make(n))
+        return n
+
+
+class Model:
+    """Run-length encoded copy of the queue, to know the expected results."""
+
+    def __init__(self):
+        self.runs = collections.deque()
+        self.size = 0
+
+    def insert(self, kid, count, head):
+        if head:
+            if self.runs and self.runs[0][0] == kid:
+                self.runs[0][1] += count
+            else:
+                self.runs.appendleft([kid, count])
+        else:
+            if self.runs and self.runs[-1][0] == kid:
+                self.runs[-1][1] += count
+            else:
+                self.runs.append([kid, count])
+        self.size += count
+
+    def remove(self, head):
+        run = self.runs[0] if head else self.runs[-1]
+        run[1] -= 1
+        if not run[1]:
+            if head:
+                self.runs.popleft()
+            else:
+                self.runs.pop()
+        self.size -= 1
+        return run[0]
+
+    def reverse(self):
+        self.runs.reverse()
+
+    def sort(self, keys):
+        counts = collections.Counter()
+        for kid, count in self.runs:
+            counts[kid] += count
+        order = sorted(counts, key=lambda kid: keys.strings[kid])
+        self.runs = collections.deque([kid, counts[kid]] for kid in order)
+
+    # q_delete_dup keeps one element of each run of equal strings
+    def dedup(self):
+        for run in self.runs:
+            run[1] = 1
+        self.size = len(self.runs)
+
+
+def parseSizes(spec):
+    """Either LOW:HIGH for every power of ten in between, or a list"""
+    if ":" in spec:
+        low, high = [int(float(v)) for v in spec.split(":")]
+        sizes = []
+        n = low
+        while n <= high:
+            sizes.append(n)
+            n *= 10
+        return sizes
+    return [int(float(v)) for v in spec.split(",")]
+
+
+def parseMix(spec):
+    mix = {}
+    for item in spec.split(","):
+        op, weight = item.split("=")
+        if op not in MIX_OPS:
+            raise ValueError("unknown operation '%s' in mix" % op)
+        mix[op] = float(weight)
+    return mix
+
+
+def parseLength(spec):
+    if ":" in spec:
+        low, high = [int(v) for v in spec.split(":")]
+        return low, high
+    return int(spec), int(spec)
+
+
+def generate(out, size, ops, mix, final, runLen, keys, rng):
+    model = Model()
+    counts = collections.Counter()
+    lines = 0
+
+    def emit(line):
+        nonlocal lines
+        out.write(line + "\n")
+        lines += 1
+
+    emit("option fail 0")
+    emit("option malloc 0")
+    emit("new")
+
+    # Fill the queue, inserting runs of equal keys at the tail
+    while model.size < size:
+        count = min(size - model.size, max(1, int(rng.expovariate(1.0 / runLen) + 0.5)))
+        kid = keys.next()
+        model.insert(kid, count, False)
+        emit("it %s %d" % (keys.strings[kid], count) if count > 1 else
+             "it %s" % keys.strings[kid])
+        counts["it"] += count
+
+    names = sorted(mix)
+    weights = [mix[op] for op in names]
+    for _ in range(ops):
+        op = rng.choices(names, weights)[0]
+        # Removing from an empty queue is an error, so insert instead
+        if op in ("rh", "rt") and not model.size:
+            op = "it" if op == "rt" else "ih"
+        if op in ("ih", "it"):
+            kid = keys.next()
+            model.insert(kid, 1, op == "ih")
+            emit("%s %s" % (op, keys.strings[kid]))
+        elif op in ("rh", "rt"):
+            kid = model.remove(op == "rh")
+            emit("%s %s" % (op, keys.strings[kid]))
+        else:
+            emit("size")
+        counts[op] += 1
+
+    for op in final:
+        if op == "reverse":
+            model.reverse()
+        elif op == "sort":
+            model.sort(keys)
+        elif op == "dedup":
+            model.dedup()
+        emit(op)
+        counts[op] += 1
+
+    emit("free")
+    return {
+        "commands": lines,
+        "operations": dict(counts),
+        "expected": {
+            "final_size": model.size,
+            "head": keys.strings[model.runs[0][0]] if model.runs else None,
+            "tail": keys.strings[model.runs[-1][0]] if model.runs else None,
+            "distinct_keys": len(keys.strings),
+        },
+    }
+
+
+def usage(name):
+    print("Usage: %s [-h] [-d DIR] [-n SIZES] [-k OPS] [-m MIX] [-f FINAL]" % name)
+    print("          [-z ZIPF] [-u DUP] [-l LEN] [-r RUN] [-s SEED]")
+    print("  -h        Print this message")
+    print("  -d DIR    Write traces and manifest.json to DIR (default traces/gen)")
+    print("  -n SIZES  Queue sizes: LOW:HIGH for powers of ten, or a list (default 1e3:1e6)")
+    print("  -k OPS    Mixed operations per trace once the queue is full (default 10000)")
+    print("  -m MIX    Weights of mixed operations (default ih=2,it=2,rh=1,rt=1,size=1)")
+    print("  -f FINAL  Whole queue operations at the end (default reverse,sort)")
+    print("  -z ZIPF   Zipf exponent for choosing reused keys, 0 for uniform (default 1.0)")
+    print("  -u DUP    Fraction of insertions that reuse a key (default 0.5)")
+    print("  -l LEN    Key length, or MIN:MAX for uniform lengths (default 5:10)")
+    print("  -r RUN    Mean run of equal keys when filling (default: size / 1e6, at least 1)")
+    print("  -s SEED   Random seed (default 1)")
+    sys.exit(0)
+
+
+def run(name, args):
+    outDir = "traces/gen"
+    sizes = parseSizes("1e3:1e6")
+    ops = 10000
+    mix = parseMix("ih=2,it=2,rh=1,rt=1,size=1")
+    final = ["reverse", "sort"]
+    zipf = 1.0
+    dupRatio = 0.5
+    minLen, maxLen = 5, 10
+    runLen = None
+    seed = 1
+
+    optlist, args = getopt.getopt(args, 'hd:n:k:m:f:z:u:l:r:s:')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-d':
+            outDir = val
+        elif opt == '-n':
+            sizes = parseSizes(val)
+        elif opt == '-k':
+            ops = int(float(val))
+        elif opt == '-m':
+            mix = parseMix(val)
+        elif opt == '-f':
+            final = [op for op in val.split(",") if op]
+        elif opt == '-z':
+            zipf = float(val)
+        elif opt == '-u':
+            dupRatio = float(val)
+        elif opt == '-l':
+            minLen, maxLen = parseLength(val)
+        elif opt == '-r':
+            runLen = float(val)
+        elif opt == '-s':
+            seed = int(val)
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+
+    for op in final:
+        if op not in FINAL_OPS:
+            print("Unknown final operation '%s'" % op)
+            usage(name)
+    # qtest does not recount the queue after dedup
+    if "dedup" in final[:-1]:
+        print("dedup must be the last final operation")
+        sys.exit(1)
+
+    os.makedirs(outDir, exist_ok=True)
+    manifest = {
+        "seed": seed,
+        "parameters": {
+            "operations": ops,
+            "mix": mix,
+            "final": final,
+            "zipf": zipf,
+            "duplicate_ratio": dupRatio,
+            "length": [minLen, maxLen],
+        },
+        "traces": [],
+    }
+    for size in sizes:
+        # Derive the stream of each trace from the seed and its size only
+        rng = random.Random("%d-%d" % (seed, size))
+        mean = runLen if runLen else max(1.0, size / 1e6)
+        keys = Keys(rng, size + ops, minLen, maxLen, dupRatio, zipf)
+        fname = "gen-%d.cmd" % size
+        with open(os.path.join(outDir, fname), "w") as out:
+            out.write("# Generated by gen-trace.py: size %d, %d mixed operations, seed %d\n"
+                      % (size, ops, seed))
+            info = generate(out, size, ops, mix, final, mean, keys, rng)
+        info.update({"file": fname, "size": size, "fill_run": mean})
+        manifest["traces"].append(info)
+        print("%s: %d commands, final size %d" %
+              (fname, info["commands"], info["expected"]["final_size"]))
+
+    with open(os.path.join(outDir, "manifest.json"), "w") as f:
+        json.dump(manifest, f, indent=2)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
@@ -0,0 +1,201 @@
+/* Vectorized string comparison for the queue sorts */
+
+#include "strcmp_simd.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "report.h"
+
+/* Always set on x86-64, and on 32-bit x86 only when building for SSE2 */
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define HAVE_SSE2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+#define PAGE_SIZE 4096
+
+/* Loads of width bytes at p and q would stay within their pages */
+static inline bool fits_page(const char *p, const char *q, size_t width)
+{
+    return ((uintptr_t) p & (PAGE_SIZE - 1)) <= PAGE_SIZE - width &&
+           ((uintptr_t) q & (PAGE_SIZE - 1)) <= PAGE_SIZE - width;
+}
+
+/* Compare up to n bytes one at a time; *done tells if the result is final */
+static inline int compare_bytes(const char *a,
+                                const char *b,
+                                size_t n,
+                                bool *done)
+{
+    for (size_t i = 0; i < n; i++) {
+        unsigned char ca = a[i], cb = b[i];
+        if (ca != cb || !ca) {
+            *done = true;
+            return ca - cb;
+        }
+    }
+    *done = false;
+    return 0;
+}
+
+static int compare_scalar(const char *a, const char *b)
+{
+    const unsigned char *p = (const unsigned char *) a;
+    const unsigned char *q = (const unsigned char *) b;
+    while (*p && *p == *q) {
+        p++;
+        q++;
+    }
+    return *p - *q;
+}
+
+/*
+ * The vector kernels read whole blocks, past the terminating NUL of the
+ * shorter string, which is harmless as long as no block crosses a page.
+ * A block that would is compared byte by byte instead.
+ */
+
+#ifdef HAVE_SSE2
+__attribute__((no_sanitize_address)) static int compare_sse2(const char *a,
+                                                             const char *b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (;; a += 16, b += 16) {
+        if (!fits_page(a, b, 16)) {
+            bool done;
+            int r = compare_bytes(a, b, 16, &done);
+            if (done)
+                return r;
+            continue;
+        }
+        __m128i va = _mm_loadu_si128((const __m128i *) a);
+        __m128i vb = _mm_loadu_si128((const __m128i *) b);
+        /* Bytes that differ, or end the string */
+        unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) |
+                        _mm_movemask_epi8(_mm_cmpeq_epi8(va, zero));
+        mask &= 0xffff;
+        if (mask) {
+            int i = __builtin_ctz(mask);
+            return (unsigned char) a[i] - (unsigned char) b[i];
+        }
+    }
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) static int compare_avx2(
+    const char *a,
+    const char *b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    for (;; a += 32, b += 32) {
+        if (!fits_page(a, b, 32)) {
+            bool done;
+            int r = compare_bytes(a, b, 32, &done);
+            if (done) {
+                _mm256_zeroupper();
+                return r;
+            }
+            continue;
+        }
+        __m256i va = _mm256_loadu_si256((const __m256i *) a);
+        __m256i vb = _mm256_loadu_si256((const __m256i *) b);
+        uint32_t mask =
+            ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) |
+            (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, zero));
+        if (mask) {
+            int i = __builtin_ctz(mask);
+            /* Leaving the upper halves dirty slows the caller's SSE code */
+            _mm256_zeroupper();
+            return (unsigned char) a[i] - (unsigned char) b[i];
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_NEON
+__attribute__((no_sanitize_address)) static int compare_neon(const char *a,
+                                                             const char *b)
+{
+    for (;; a += 16, b += 16) {
+        if (!fits_page(a, b, 16)) {
+            bool done;
+            int r = compare_bytes(a, b, 16, &done);
+            if (done)
+                return r;
+            continue;
+        }
+        uint8x16_t va = vld1q_u8((const uint8_t *) a);
+        uint8x16_t vb = vld1q_u8((const uint8_t *) b);
+        /* 0xff in the bytes that differ, or end the string */
+        uint8x16_t stop = vorrq_u8(vmvnq_u8(vceqq_u8(va, vb)), vceqzq_u8(va));
+        /* Narrow to four bits per byte to get a 64-bit mask */
+        uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(stop), 4)),
+            0);
+        if (mask) {
+            int i = __builtin_ctzll(mask) >> 2;
+            return (unsigned char) a[i] - (unsigned char) b[i];
+        }
+    }
+}
+#endif
+
+static int compare_resolve(const char *a, const char *b);
+
+int (*str_compare)(const char *a, const char *b) = compare_resolve;
+
+typedef struct {
+    const char *name;
+    int (*compare)(const char *a, const char *b);
+} kernel_t;
+
+/* Vector kernels the CPU supports, fastest first, ending with NULL */
+static void supported_kernels(kernel_t *kernels)
+{
+    int n = 0;
+#ifdef HAVE_SSE2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels[n++] = (kernel_t){"avx2", compare_avx2};
+    kernels[n++] = (kernel_t){"sse2", compare_sse2};
+#endif
+#ifdef HAVE_NEON
+    kernels[n++] = (kernel_t){"neon", compare_neon};
+#endif
+    kernels[n] = (kernel_t){NULL, NULL};
+}
+
+static void resolve()
+{
+    const char *want = getenv("QTEST_STRCMP");
+    kernel_t kernels[3];
+
+    if (want && !*want)
+        want = NULL;
+    str_compare = compare_scalar;
+    if (want && !strcmp(want, "scalar"))
+        return;
+    supported_kernels(kernels);
+    for (kernel_t *k = kernels; k->name; k++) {
+        if (!want || !strcmp(want, k->name)) {
+            str_compare = k->compare;
+            return;
+        }
+    }
+    if (want)
+        report_event(MSG_ERROR,
+                     "QTEST_STRCMP=%s is unknown or not supported here, "
+                     "comparing strings byte by byte",
+                     want);
+}
+
+/* The first call picks the kernel for every later one */
+static int compare_resolve(const char *a, const char *b)
+{
+    resolve();
+    return str_compare(a, b);
+}
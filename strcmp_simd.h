@@ -0,0 +1,24 @@
+#ifndef LAB0_STRCMP_SIMD_H
+#define LAB0_STRCMP_SIMD_H
+
+#include <stdbool.h>
+
+/*
+ * String comparison that checks 16 or 32 bytes per step with SSE2, AVX2 or
+ * NEON, whichever the CPU supports, and byte by byte elsewhere.  The kernel
+ * is picked on the first call; setting QTEST_STRCMP to scalar, sse2, avx2
+ * or neon in the environment overrides the choice, e.g. for valgrind, which
+ * reports the reads past the end of a string that the vector kernels make
+ * (they never cross into another page).  A kernel that is unknown or not
+ * available is reported, and the byte by byte comparison used instead.
+ */
+
+/* Same result sign as strcmp */
+extern int (*str_compare)(const char *a, const char *b);
+
+static inline bool str_equal(const char *a, const char *b)
+{
+    return !str_compare(a, b);
+}
+
+#endif /* LAB0_STRCMP_SIMD_H */
@@ -0,0 +1,5 @@
+# Test of compiling traces into binary files
+option fail 0
+option malloc 0
+compile traces/trace-01-ops.cmd /tmp/qtest.trace-01.bin
+compile traces/trace-07-string.cmd /tmp/qtest.trace-07.bin